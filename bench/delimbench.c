@@ -0,0 +1,233 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Delimiter scanning microbenchmark.
+ *
+ * Splits the same buffer into records with each of delim.c's scanners,
+ * and with the byte-at-a-time loop streamread_delim used before them
+ * (every delimiter compared at every byte), and prints the throughput of
+ * each.  The scanners are static, so delim.c is built right into this
+ * program rather than linked from the library.  Every scanner has to find
+ * the same records as the old loop, or it exits non-zero.
+ *
+ * Usage: delimbench [megabytes [record length]]
+ *
+ */
+
+#include "delim.c"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+/* delim.c wants these from slab.c; plain malloc is fine here */
+void *__nbio_slaballoc(nbio_t *nb, size_t size)
+{
+	return malloc(size);
+}
+
+void __nbio_slabfree(nbio_t *nb, void *p, size_t size)
+{
+	free(p);
+	return;
+}
+
+/* The old way: after every byte, does any delimiter end here? */
+static int oldscan(nbio_fd_t *fdt, const unsigned char *buf, int n, nbio_delim_t **match)
+{
+	int i;
+
+	*match = NULL;
+
+	for (i = 0; i < n; i++) {
+		nbio_delim_t *cd;
+
+		for (cd = fdt->delims; cd; cd = cd->next) {
+			if ((i + 1 >= cd->len) &&
+					(memcmp(buf + i + 1 - cd->len, cd->data, cd->len) == 0)) {
+				*match = cd;
+				return i;
+			}
+		}
+	}
+
+	return n;
+}
+
+static double msnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+}
+
+/* Split buf into records, the way streamread_delim walks its stage */
+static unsigned long split(nbio_fd_t *fdt, const unsigned char *buf, int len, int old)
+{
+	nbio_buf_t cur;
+	unsigned long records = 0;
+	int off = 0;
+
+	memset(&cur, 0, sizeof(cur));
+
+	while (off < len) {
+		nbio_delim_t *cd;
+		int n;
+
+		if (old)
+			n = oldscan(fdt, buf + off, len - off, &cd);
+		else
+			n = __fdt_delimscan(fdt, &cur, buf + off, len - off, &cd);
+
+		if (!cd)
+			break;
+
+		off += n + 1;
+		records += off; /* so a record found in the wrong place shows up */
+	}
+
+	return records;
+}
+
+static int run(const char *name, nbio_fd_t *fdt, const unsigned char *buf, int len, int reps, int old, unsigned long want)
+{
+	unsigned long got = 0;
+	double start, el;
+	int i;
+
+	start = msnow();
+	for (i = 0; i < reps; i++)
+		got = split(fdt, buf, len, old);
+	el = msnow() - start;
+
+	printf("  %-8s %9.1f MB/s%s\n", name,
+			((double)len * reps / (1024.0 * 1024.0)) / ((el > 0) ? el / 1000.0 : 1e-9),
+			(!old && (got != want)) ? "  MISMATCH" : "");
+
+	return (!old && (got != want)) ? -1 : 0;
+}
+
+static int bench(const char *label, const char **delims, int ndelims, const unsigned char *buf, int len, int reps)
+{
+	nbio_fd_t fdt;
+	struct nbio__delimset *ds;
+	unsigned long want;
+	nbio_delim_t *cd;
+	int i, ret = 0;
+
+	memset(&fdt, 0, sizeof(fdt));
+
+	/* nbio_adddelim puts new ones at the front */
+	for (i = 0; i < ndelims; i++) {
+		cd = malloc(sizeof(nbio_delim_t));
+		cd->len = strlen(delims[i]);
+		memcpy(cd->data, delims[i], cd->len);
+		cd->next = fdt.delims;
+		fdt.delims = cd;
+	}
+
+	if (__fdt_delimcompile(&fdt) == -1)
+		return -1;
+	ds = (struct nbio__delimset *)fdt.delimset;
+
+	printf("%s (%d distinct final byte%s)\n", label, ds->nlast, (ds->nlast == 1) ? "" : "s");
+
+	want = split(&fdt, buf, len, 1);
+	run("old", &fdt, buf, len, reps, 1, want);
+
+	if (ds->nlast == 1) {
+		ds->find = find_memchr;
+		ret |= run("memchr", &fdt, buf, len, reps, 0, want);
+	}
+
+	ds->find = find_table;
+	ret |= run("table", &fdt, buf, len, reps, 0, want);
+
+#ifdef NBIO_DELIM_X86
+	if (ds->nlast <= NBIO_DELIM_VECMAX) {
+		if (__builtin_cpu_supports("sse2")) {
+			ds->find = find_sse2;
+			ret |= run("sse2", &fdt, buf, len, reps, 0, want);
+		}
+		if (__builtin_cpu_supports("avx2")) {
+			ds->find = find_avx2;
+			ret |= run("avx2", &fdt, buf, len, reps, 0, want);
+		}
+	}
+#endif
+
+	__fdt_delimfree(&fdt);
+	while ((cd = fdt.delims)) {
+		fdt.delims = cd->next;
+		free(cd);
+	}
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *lines[] = { "\n", "\r\n", "\r\n\r\n" };
+	static const char *fields[] = { "\n", ";", "|" };
+	static const char *many[] = { "\n", ";", "|", ",", "\t", ":" };
+	unsigned char *buf;
+	int len, reclen, reps, i, ret = 0;
+
+	len = ((argc > 1) ? atoi(argv[1]) : 1) * 1024 * 1024;
+	reclen = (argc > 2) ? atoi(argv[2]) : 80;
+	if ((len <= 0) || (reclen < 2)) {
+		fprintf(stderr, "usage: %s [megabytes [record length]]\n", argv[0]);
+		return 1;
+	}
+	reps = (64 * 1024 * 1024) / len;
+	if (reps < 1)
+		reps = 1;
+
+	if (!(buf = malloc(len)))
+		return 1;
+
+	/* Printable filler, with a delimiter of each kind every so often */
+	srand(1);
+	for (i = 0; i < len; i++)
+		buf[i] = 'a' + (rand() % 26);
+	for (i = reclen - 1; i < len; i += reclen) {
+		switch (rand() % 4) {
+		case 0: buf[i] = '\n'; break;
+		case 1: buf[i] = ';'; break;
+		case 2: buf[i] = '|'; break;
+		case 3: buf[i] = ':'; break;
+		}
+	}
+
+	printf("%d bytes, records about %d bytes, %d passes\n", len, reclen, reps);
+
+	ret |= bench("lines", lines, 3, buf, len, reps);
+	ret |= bench("fields", fields, 3, buf, len, reps);
+	ret |= bench("many", many, 6, buf, len, reps);
+
+	free(buf);
+
+	return ret ? 1 : 0;
+}
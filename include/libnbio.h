@@ -56,8 +56,11 @@ typedef struct nbio_buf_s {
 	int len;
 	int offset;
 	time_t trigger; /* time at which the event should be triggered */
+	int pooled; /* rx buffer the library attached (nbio_setrxpool, or a frame) */
 	void *intdata;
 	struct nbio_buf_s *next;
+	struct nbio_buf_s *prev;
+	struct nbio_buf_s **chain; /* the fdt's rxchain or txchain, while it's on it */
 } nbio_buf_t;
 
 
@@ -65,6 +68,12 @@ typedef struct nbio_buf_s {
 #define NBIO_FDTYPE_STREAM    1
 #define NBIO_FDTYPE_DGRAM     2
 
+/*
+ * Or'd into nbio_addfd()'s type when the socket is non-blocking already
+ * (eg, from nbio_acceptbatch()), so it isn't set again.
+ */
+#define NBIO_FDTYPE_FLAG_NONBLOCK 0x0100
+
 
 #define NBIO_EVENT_READ           0 /* buffer read (or socket is readable) */
 #define NBIO_EVENT_WRITE          1 /* buffer written (or socket is writable) */
@@ -75,6 +84,9 @@ typedef struct nbio_buf_s {
 #define NBIO_EVENT_RESOLVERESULT  6 /* result of a resolver operation */
 #define NBIO_EVENT_TIMEREXPIRE    7 /* timer expired */
 #define NBIO_EVENT_INCOMINGCONN   8 /* (listener only) new incoming conn */
+#define NBIO_EVENT_NEEDRXBUF      9 /* (shared reads) data arrived, no rx buffer */
+#define NBIO_EVENT_TXFULL        10 /* queued tx bytes reached the high watermark */
+#define NBIO_EVENT_TXDRAINED     11 /* and are back down to the low watermark */
 
 typedef unsigned short nbio_fdt_flags_t;
 
@@ -94,6 +106,9 @@ typedef unsigned short nbio_fdt_flags_t;
  * The close-on-flush flag tells the system to close the fdt as soon
  * as there is no more data waiting to be written. If there are no
  * pending txvecs, then this equates to "close on next call to nbio_poll()".
+ * Either way, the handler gets NBIO_EVENT_EOF once (from nbio_poll(), or
+ * nbio_cleanuponly() if that's called first), and is expected to close
+ * the fdt then.
  *
  * This is useful for doing things where you would normally do:
  *    write();
@@ -120,6 +135,26 @@ typedef unsigned short nbio_fdt_flags_t;
  */
 #define NBIO_FDT_FLAG_INTERNAL     0x0040
 
+/*
+ * Shared reads; see nbio_setsharedrx().
+ */
+#define NBIO_FDT_FLAG_SHAREDRX     0x0080
+
+/*
+ * Over the tx high watermark; see nbio_settxwatermarks().
+ */
+#define NBIO_FDT_FLAG_TXFULL       0x0100
+
+/*
+ * The EOF has been delivered, so close-on-flush won't send another.
+ */
+#define NBIO_FDT_FLAG_EOFSENT      0x0200
+
+/*
+ * Edge-triggered; see nbio_setedge().
+ */
+#define NBIO_FDT_FLAG_EDGE         0x0400
+
 
 typedef struct nbio_delim_s {
 	unsigned char len;
@@ -128,23 +163,46 @@ typedef struct nbio_delim_s {
 } nbio_delim_t;
 
 
+/* used only by delim.c */
+struct nbio__delimset;
+
 typedef struct nbio_fd_s {
+	void *nb; /* nbio_t this belongs to */
 	int type;
 	nbio_sockfd_t fd;
 	nbio_fdt_flags_t flags;
 	int (*handler)(void *, int event, struct nbio_fd_s *); /* nbio_handler_t */
 	void *priv;
 	nbio_delim_t *delims;
+	struct nbio__delimset *delimset; /* delims, compiled */
+	int framing; /* NBIO_FRAME_* */
+	int framemax;
+	int readbudget; /* 0 means use nbio_t's */
+	int rxpoollen; /* nbio_setrxpool */
 	int pri;
 	nbio_buf_t *rxchain;
+	nbio_buf_t *rxchain_tail;
 	nbio_buf_t *rxchain_freelist;
 	nbio_buf_t *txchain;
 	nbio_buf_t *txchain_tail;
 	nbio_buf_t *txchain_freelist;
+	int rxqueued, txqueued; /* buffers on the chains */
+	int rxfree, txfree; /* and on the freelists */
+	int txbytes; /* queued and not yet written */
+	int txhigh, txlow; /* nbio_settxwatermarks */
+	int txfullsent; /* whether the handler was last told TXFULL */
+	time_t txwake; /* when the first delayed tx buffer is due, if waiting */
+	struct nbio_timer_s *txtimer; /* and the timer waiting for it */
 	void *intdata;
-	int timerinterval;
-	time_t timernextfire;
-	struct nbio_fd_s *next;
+	struct nbio_timer_s *timers; /* attached with nbio_addtimer */
+	struct nbio_timer_s *timer; /* the nbio_settimer() one */
+	unsigned char *rxstage; /* bulk reads for delimited streams */
+	int rxstageoff, rxstagelen; /* bytes not yet copied to the rxchain */
+	int revents; /* events waiting in the ready queue */
+	int edgeready, edgewant; /* NBIO_FDT_FLAG_EDGE: not drained yet, and polled for */
+	struct nbio_fd_s *readynext;
+	struct nbio_fd_s *closednext; /* nb->closed */
+	struct nbio_fd_s *next, *prev;
 } nbio_fd_t;
 
 typedef int (*nbio_handler_t)(void *, int event, nbio_fd_t *);
@@ -152,30 +210,78 @@ typedef int (*nbio_handler_t)(void *, int event, nbio_fd_t *);
 /* used only by resolv.c */
 struct nbio__resolvinfo;
 
+/* used only by libnbio.c */
+struct nbio__prilevel;
+
+/* used only by slab.c */
+struct nbio__slab;
+
+/* used only by bufpool.c */
+struct nbio__bufpool;
+
+/* used only by timer.c */
+struct nbio__timerwheel;
+
+/* used only by libnbio.c and the backends */
+struct nbio__backend;
+
 typedef struct {
 	void *fdlist;
+	nbio_fd_t *closed; /* closed, to be freed at the end of the pass */
+	nbio_fd_t **fdtab; /* indexed by fd (unused with winsock2) */
+	int fdtabsize;
 	int maxpri;
-	void *intdata;
+	struct nbio__prilevel *pris; /* indexed by priority */
+	int prislen;
+	int readycount; /* fdts in all of the ready queues */
+	int readbudget;
+	struct nbio__slab *slab;
+	struct nbio__bufpool *bufpool;
+	unsigned char *rxscratch; /* read buffer for NBIO_FDT_FLAG_SHAREDRX streams */
+	struct nbio__timerwheel *timers;
+	unsigned long long nowms; /* monotonic ms, sampled once a pass */
+	time_t now; /* and the wall clock, for tx triggers */
+	int inpass; /* set while handlers are being called */
+	const struct nbio__backend *backend;
+	void *intdata; /* the backend's */
 	void *priv;
 	struct nbio__resolvinfo *resolv;
-#if 0
-#ifdef NBIO_USEKQUEUE
-	int kq;
-	struct kevent *kqevents;
-	int kqeventslen;
-	struct kevent *kqchanges;
-	int kqchangeslen;
-	int kqchangecount;
-#endif
-#endif
 } nbio_t;
 
+/*
+ * Backends.
+ *
+ * Every backend the platform has is built in, and nbio_init_ex() says
+ * which one to use.  NBIO_BACKEND_AUTO means the one configure picked,
+ * or if that fails to start (eg, io_uring on a kernel without it), the
+ * fastest of the others that works.  nbio_init() is the same as
+ * NBIO_BACKEND_AUTO.  Asking for one that isn't built in fails with
+ * ENOSYS.
+ *
+ * If $NBIO_BACKEND is set to the name of a backend ("epoll", "poll",
+ * "select", "uring", "kqueue", "winsock2", or "auto"), that's used instead
+ * of what the program asked for, with no falling back: nbio_init_ex()
+ * fails with ENOSYS if it isn't built in (or whatever it failed with if
+ * it wouldn't start), and with EINVAL for a name that isn't one of those.
+ *
+ * nbio_getbackend() says which one it ended up with.
+ */
+#define NBIO_BACKEND_AUTO     0
+#define NBIO_BACKEND_POLL     1
+#define NBIO_BACKEND_SELECT   2
+#define NBIO_BACKEND_EPOLL    3
+#define NBIO_BACKEND_KQUEUE   4
+#define NBIO_BACKEND_URING    5
+#define NBIO_BACKEND_WINSOCK2 6
+int nbio_init_ex(nbio_t *nb, int pfdsize, int backend);
+int nbio_getbackend(nbio_t *nb);
 int nbio_init(nbio_t *nb, int pfdsize);
 int nbio_kill(nbio_t *nb);
 void nbio_alleofforce(nbio_t *nb);
 void nbio_flushall(nbio_t *nb);
 nbio_fd_t *nbio_iter(nbio_t *nb, int (*matcher)(nbio_t *nb, void *ud, nbio_fd_t *fdt), void *userdata);
 nbio_fd_t *nbio_getfdt(nbio_t *nb, nbio_sockfd_t fd);
+#define NBIO_PRI_MAX 1023 /* highest pri nbio_addfd() and nbio_setpri() take */
 nbio_fd_t *nbio_addfd(nbio_t *nb, int type, nbio_sockfd_t fd, int pri, nbio_handler_t handler, void *priv, int rxlen, int txlen);
 int nbio_closefdt(nbio_t *nb, nbio_fd_t *fdt);
 int nbio_sfd_close(nbio_t *nb, nbio_sockfd_t fd);
@@ -186,6 +292,37 @@ int nbio_poll(nbio_t *nb, int timeout);
 int nbio_setpri(nbio_t *nb, nbio_fd_t *fdt, int pri);
 int nbio_connect(nbio_t *nb, const struct sockaddr *addr, int addrlen, nbio_handler_t handler, void *priv);
 int nbio_settimer(nbio_t *nb, nbio_fd_t *fdt, int interval);
+
+/*
+ * Timers.
+ *
+ * nbio_addtimer() runs a timer ms milliseconds from now, and then every
+ * interval milliseconds (or just once, if interval is zero), on the
+ * monotonic clock.  It calls callback, or if that's NULL, fdt's handler
+ * with NBIO_EVENT_TIMEREXPIRE.  A timer with an fdt goes away when the
+ * fdt is closed; one without needs a callback.  Any number of timers can
+ * be on the same fdt.
+ *
+ * nbio_deltimer() stops a timer, and may be called from its own callback.
+ * A one-shot timer is gone once its callback returns, so its handle is no
+ * good after that.  Returning -1 from a callback is the same as from a
+ * handler (it ends nbio_poll with -1).
+ *
+ * nbio_settimer() is the old, one-per-fdt interface; its interval is in
+ * seconds.
+ *
+ * The clocks are read once each time nbio_poll wakes up, and everything
+ * in that pass shares the result.  nbio_now() is that time on the
+ * monotonic clock, in ms, and nbio_time() is the wall clock time, as tx
+ * triggers use.  Timers added from a handler count from nbio_now(), not
+ * from the moment they're added.
+ */
+typedef struct nbio_timer_s nbio_timer_t;
+typedef int (*nbio_timer_callback_t)(nbio_t *nb, nbio_timer_t *timer, void *udata);
+nbio_timer_t *nbio_addtimer(nbio_t *nb, nbio_fd_t *fdt, int ms, int interval, nbio_timer_callback_t callback, void *udata);
+int nbio_deltimer(nbio_t *nb, nbio_timer_t *timer);
+unsigned long long nbio_now(nbio_t *nb);
+time_t nbio_time(nbio_t *nb);
 int nbio_sfd_read(nbio_t *nb, nbio_sockfd_t fd, void *buf, int count);
 int nbio_sfd_write(nbio_t *nb, nbio_sockfd_t fd, const void *buf, int count);
 nbio_sockfd_t nbio_sfd_accept(nbio_t *nb, nbio_sockfd_t fd, struct sockaddr *saret, int *salen);
@@ -208,6 +345,20 @@ unsigned char *nbio_remtoptxvector(nbio_t *nb, nbio_fd_t *fdt, int *len, int *of
 int nbio_rxavail(nbio_t *nb, nbio_fd_t *fdt);
 int nbio_txavail(nbio_t *nb, nbio_fd_t *fdt);
 
+/*
+ * The same as nbio_add[rt]xvector_time(), but these return the buffer's
+ * handle, and nbio_rem[rt]xbuf() take one out by it without searching the
+ * chain.  The handle is only good until the buffer comes off the chain;
+ * after that (or given one from another fdt), they fail with EINVAL.
+ *
+ * nbio_rxavail() and nbio_txavail() return how many more buffers can be
+ * queued; fdt->rxqueued and fdt->txqueued are how many are.
+ */
+nbio_buf_t *nbio_addrxbuf(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen, int offset, time_t trigger);
+int nbio_remrxbuf(nbio_t *nb, nbio_fd_t *fdt, nbio_buf_t *buf);
+nbio_buf_t *nbio_addtxbuf(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen, time_t trigger);
+int nbio_remtxbuf(nbio_t *nb, nbio_fd_t *fdt, nbio_buf_t *buf);
+
 
 /*
  * Stream delimiters.
@@ -238,6 +389,131 @@ int nbio_cleardelim(nbio_fd_t *fdt);
  */
 int nbio_setkeepdelim(nbio_fd_t *fdt, int val);
 
+/*
+ * Length-prefixed framing.
+ *
+ * Instead of delimiters, each record on the stream can start with its
+ * length: a 16 or 32 bit big-endian integer, or an unsigned LEB128 varint
+ * of up to five bytes.  The length doesn't include the header itself.
+ *
+ * The library reads the header, takes a pool buffer (see below) for that
+ * many bytes, and puts it on the rxchain.  Once it's full, the read callback
+ * is called, and the application takes it with nbio_remtoprxvector() (the
+ * header isn't included) and must nbio_bufrelease() it.  Frames longer than maxlen
+ * are an NBIO_EVENT_ERROR, with errno set to EMSGSIZE.
+ *
+ * Framing overrides delimiters.  Set NBIO_FRAME_NONE to go back to
+ * delimited or plain buffered reads; anything already read past the last
+ * frame is kept for them.
+ *
+ */
+#define NBIO_FRAME_NONE   0
+#define NBIO_FRAME_U16BE  1
+#define NBIO_FRAME_U32BE  2
+#define NBIO_FRAME_VARINT 3
+int nbio_setframing(nbio_t *nb, nbio_fd_t *fdt, int framing, int maxlen);
+
+/*
+ * Read budget.
+ *
+ * By default a readable stream gets one read() per nbio_poll().  With a
+ * budget, it keeps reading (and calling back) until the socket would
+ * block or the budget, in bytes, is used up; then it's the next fdt's
+ * turn, and the rest waits for the next pass.  A budget on an fdt
+ * overrides the one for the whole nbio_t (fdt == NULL).  Zero means the
+ * default behavior.
+ */
+int nbio_setreadbudget(nbio_t *nb, nbio_fd_t *fdt, int bytes);
+
+/*
+ * Buffer pool.
+ *
+ * Reference counted buffers, recycled through per-size free lists instead
+ * of going back to malloc every time.  nbio_bufget() returns one with a
+ * single reference (and undefined contents); nbio_bufrelease() drops a
+ * reference.  They can be used anywhere the application would otherwise
+ * use its own buffers, so one that came in on one connection can be
+ * passed straight to nbio_addtxvector() on another, and released in that
+ * one's write callback.  Use nbio_bufref() to send it to several.
+ *
+ * Released buffers are kept for reuse, up to nbio_setbufpoolmax() bytes
+ * (4MB by default).  All pool buffers must be released before nbio_kill().
+ */
+unsigned char *nbio_bufget(nbio_t *nb, int len);
+int nbio_bufref(nbio_t *nb, unsigned char *buf);
+int nbio_bufrelease(nbio_t *nb, unsigned char *buf);
+int nbio_setbufpoolmax(nbio_t *nb, int bytes);
+
+/*
+ * Have the library keep a buflen byte pool buffer queued for reading on a
+ * stream, so the application never has to add rx buffers.  Each one is
+ * given to the read callback as usual; take it with nbio_remtoprxvector()
+ * and release it (or pass it on) when done.  Zero turns this off.
+ */
+int nbio_setrxpool(nbio_t *nb, nbio_fd_t *fdt, int buflen);
+
+/*
+ * Shared reads.
+ *
+ * Normally a stream needs an rx buffer queued (and, once it's been read
+ * from, a staging buffer) for as long as it's open, even while it's idle.
+ * With shared reads on, it's read into a buffer shared by the whole nbio_t,
+ * and only gets buffers of its own once data arrives: a pool buffer if
+ * nbio_setrxpool() is set, or otherwise whatever the application adds with
+ * nbio_addrxvector() when it's called with NBIO_EVENT_NEEDRXBUF.  Once the
+ * data has been handed out, pool buffers with nothing in them go back to
+ * the pool, so a stream with no partial record holds no rx memory at all.
+ */
+int nbio_setsharedrx(nbio_t *nb, nbio_fd_t *fdt, int val);
+
+/*
+ * Send queue watermarks.
+ *
+ * Once the bytes queued on a stream and not yet written (fdt->txbytes)
+ * reach high, the handler gets NBIO_EVENT_TXFULL, and when they're back
+ * down to low, NBIO_EVENT_TXDRAINED, so a producer knows when to stop
+ * and start again.  Both come from nbio_poll(), never from inside
+ * nbio_addtxvector().  Nothing is refused at the high watermark; it's up
+ * to the application to stop.  A high of zero turns them off.
+ */
+int nbio_settxwatermarks(nbio_t *nb, nbio_fd_t *fdt, int high, int low);
+
+/*
+ * Edge-triggered streams.
+ *
+ * The stream is registered with the kernel once, for both directions,
+ * instead of having its interest changed every time a buffer is added or
+ * taken off.  libnbio remembers that it's readable or writable until a
+ * read or write would block, and carries on by itself when it stopped
+ * short (eg, at the read budget).  In raw mode, the handler gets one
+ * NBIO_EVENT_READ or NBIO_EVENT_WRITE per edge, and has to keep going
+ * until EAGAIN itself.  Only for streams, and only with backends that
+ * can do it (epoll, kqueue); others fail with ENOSYS.
+ */
+int nbio_setedge(nbio_t *nb, nbio_fd_t *fdt, int val);
+
+/*
+ * Batched accept, for a listener's NBIO_EVENT_INCOMINGCONN handler.
+ *
+ * Accepts connections until there are none left, or max of them (zero
+ * for no limit), and hands each one to cb.  The sockets come back
+ * non-blocking and close-on-exec already (from a single accept4() where
+ * there is one), so cb can add them with NBIO_FDTYPE_FLAG_NONBLOCK to
+ * skip setting that again.  cb owns the socket: it has to add it or
+ * close it.  Returns
+ * the number accepted (zero if there was nothing to accept), or -1 if the
+ * first accept failed or cb returned -1.
+ */
+typedef int (*nbio_accept_callback_t)(nbio_t *nb, nbio_fd_t *listener, nbio_sockfd_t fd, struct sockaddr *sa, int salen);
+int nbio_acceptbatch(nbio_t *nb, nbio_fd_t *listener, nbio_accept_callback_t cb, int max);
+
+/*
+ * Back the internal allocator (fdts, buffer nodes, and so on) with huge
+ * pages, where the system has them.  Only affects memory allocated after
+ * the call, so do it right after nbio_init().
+ */
+int nbio_sethugepages(nbio_t *nb, int val);
+
 /*
  * Non-blocking DNS resolution.  Returns struct hostent to callback, just as
  * gethostbyname() would have.  Returning -1 from the callback is the same as
@@ -454,8 +454,8 @@ int sendmsncmd(nbio_fd_t *fdt, const char *cmd, int usetrid, ntrid_t trid, const
 	if (args)
 		buflen += 1 + strlen(args);
 
-	if (!(buf = malloc(buflen))) {
-		fdtperror(fdt, "sendmsncmd: malloc", errno, cmd);
+	if (!(buf = (char *)nbio_bufget(mci->mi->nb, buflen))) {
+		fdtperror(fdt, "sendmsncmd: nbio_bufget", errno, cmd);
 		return -1;
 	}
 
@@ -504,7 +504,7 @@ int sendmsncmd(nbio_fd_t *fdt, const char *cmd, int usetrid, ntrid_t trid, const
 
 	if (nbio_addtxvector(mci->mi->nb, fdt, buf, strlen(buf)) == -1) {
 		fdtperror(fdt, "sendmsncmd: nbio_addtxvector", errno, cmd);
-		free(buf);
+		nbio_bufrelease(mci->mi->nb, (unsigned char *)buf);
 		return -1;
 	}
 
@@ -276,13 +276,13 @@ static int addmsnvec(nbio_t *nb, nbio_fd_t *fdt)
 	unsigned char *buf;
 	int buflen = MSN_CMD_MAXLEN + MSN_CMD_DELIM_LEN + 1;
 
-	if (!(buf = malloc(buflen)))
-		return fdtperror(fdt, "addmsnvec: malloc", errno, "");
+	if (!(buf = nbio_bufget(nb, buflen)))
+		return fdtperror(fdt, "addmsnvec: nbio_bufget", errno, "");
 	memset(buf, 0, buflen);
 
 	if (nbio_addrxvector(nb, fdt, buf, buflen, 0) < 0) {
 		fdtperror(fdt, "addmsnvec: nbio_addrxvector", errno, "");
-		free(buf);
+		nbio_bufrelease(nb, buf);
 		return -1;
 	}
 
@@ -484,9 +484,9 @@ static void clearbufs(nbio_t *nb, nbio_fd_t *fdt)
 		return;
 
 	for (i = 0; (buf = nbio_remtoprxvector(nb, fdt, NULL, NULL)); i++)
-		free(buf);
+		nbio_bufrelease(nb, buf);
 	for (i = 0; (buf = nbio_remtoptxvector(nb, fdt, NULL, NULL)); i++)
-		free(buf);
+		nbio_bufrelease(nb, buf);
 
 	return;
 }
@@ -621,20 +621,20 @@ static int handlecmd(nbio_fd_t *fdt)
 
 			if (!(custom = strchr(handle, ' '))) {
 				fdterror(fdt, "handlecmd: parse error for MSG");
-				free(buf);
+				nbio_bufrelease(mci->mi->nb, buf);
 				return -2;
 			}
 			custom++;
 			if (!(lenstr = strchr(custom, ' '))) {
 				fdterror(fdt, "handlecmd: parse error for MSG (len)");
-				free(buf);
+				nbio_bufrelease(mci->mi->nb, buf);
 				return -2;
 			}
 			lenstr++;
 
 			if ((msglen = atoi(lenstr)) < 1) {
 				fdterror(fdt, "handlecmd: parse error for MSG (invalid len)\n");
-				free(buf);
+				nbio_bufrelease(mci->mi->nb, buf);
 				return -2;
 			}
 
@@ -644,17 +644,17 @@ static int handlecmd(nbio_fd_t *fdt)
 			 * queue.
 			 */
 			if (nbio_addrxvector(mci->mi->nb, fdt, buf, len, len) == -1) {
-				free(buf);
+				nbio_bufrelease(mci->mi->nb, buf);
 				fdtperror(fdt, "handlecmd: nbio_addrxvector", errno, "(while adding MSG back)");
 				return -2;
 			}
-			if (!(buf = malloc(msglen+1))) {
-				fdtperror(fdt, "handlecmd: malloc", errno, "(while allocating payload buffer");
+			if (!(buf = nbio_bufget(mci->mi->nb, msglen+1))) {
+				fdtperror(fdt, "handlecmd: nbio_bufget", errno, "(while allocating payload buffer");
 				return -2;
 			}
 			memset(buf, 0, msglen+1);
 			if (nbio_addrxvector(mci->mi->nb, fdt, buf, msglen, 0) == -1) {
-				free(buf);
+				nbio_bufrelease(mci->mi->nb, buf);
 				fdtperror(fdt, "handlecmd: nbio_addrxvector", errno, "(while adding MSG payload)");
 				return -2;
 			}
@@ -690,11 +690,11 @@ static int handlecmd(nbio_fd_t *fdt)
 		}
 
 		if ((ret = processmsncmd(fdt, (char *)buf, NULL)) < 0) {
-			free(buf);
+			nbio_bufrelease(mci->mi->nb, buf);
 			return ret;
 		}
 
-		free(buf);
+		nbio_bufrelease(mci->mi->nb, buf);
 		addmsnvec(mci->mi->nb, fdt);
 		mci->state = MCI_STATE_WAITINGFORCMD; /* no change */
 
@@ -749,13 +749,13 @@ static int handlecmd(nbio_fd_t *fdt)
 		}
 
 		if ((ret = processmsncmd(fdt, (char *)buf, payload)) < 0) {
-			free(payload);
-			free(buf);
+			nbio_bufrelease(mci->mi->nb, (unsigned char *)payload);
+			nbio_bufrelease(mci->mi->nb, buf);
 			return ret;
 		}
 
-		free(payload);
-		free(buf);
+		nbio_bufrelease(mci->mi->nb, (unsigned char *)payload);
+		nbio_bufrelease(mci->mi->nb, buf);
 
 		mci->state = MCI_STATE_WAITINGFORCMD;
 		addmsnvec(mci->mi->nb, fdt);
@@ -802,7 +802,7 @@ static int msn_callback(void *nbv, int event, nbio_fd_t *fdt)
 		int offset, len;
 
 		if ((buf = nbio_remtoptxvector(nb, fdt, &len, &offset)))
-			free(buf);
+			nbio_bufrelease(nb, buf);
 
 		return 0;
 
@@ -0,0 +1,222 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Reference counted data buffers for the application.
+ *
+ * Each buffer has a small header in front of it with its reference count
+ * and size class.  Released buffers are kept on per-class free lists, up
+ * to a limit on the total bytes kept, and handed out again by nbio_bufget.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <libnbio.h>
+#include "impl.h"
+
+#define NBIO_BUFPOOL_MINSHIFT 6 /* 64 bytes */
+#define NBIO_BUFPOOL_MAXSHIFT 16 /* 64KB */
+#define NBIO_BUFPOOL_CLASSES (NBIO_BUFPOOL_MAXSHIFT - NBIO_BUFPOOL_MINSHIFT + 1)
+
+/* default for nbio_setbufpoolmax */
+#define NBIO_BUFPOOL_DEFMAX (4 * 1024 * 1024)
+
+/* in front of every buffer; padded so the data stays aligned */
+union bufhdr {
+	struct {
+		union bufhdr *next; /* on a free list */
+		int refs;
+		int class; /* -1 if too big to keep */
+	} h;
+	double align[2];
+};
+
+struct nbio__bufpool {
+	union bufhdr *freelists[NBIO_BUFPOOL_CLASSES];
+	size_t cached; /* bytes sitting on the free lists */
+	size_t max;
+};
+
+#define BUFHDR(buf) ((union bufhdr *)(buf) - 1)
+
+static size_t classsize(int class)
+{
+	return (size_t)1 << (class + NBIO_BUFPOOL_MINSHIFT);
+}
+
+int __nbio_bufpoolinit(nbio_t *nb)
+{
+
+	if (!(nb->bufpool = malloc(sizeof(struct nbio__bufpool)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(nb->bufpool, 0, sizeof(struct nbio__bufpool));
+
+	nb->bufpool->max = NBIO_BUFPOOL_DEFMAX;
+
+	return 0;
+}
+
+static void trim(struct nbio__bufpool *bp, size_t max)
+{
+	int i;
+
+	/* biggest first, so the fewest buffers are lost */
+	for (i = NBIO_BUFPOOL_CLASSES - 1; (i >= 0) && (bp->cached > max); i--) {
+		union bufhdr *hdr;
+
+		while ((bp->cached > max) && (hdr = bp->freelists[i])) {
+			bp->freelists[i] = hdr->h.next;
+			bp->cached -= classsize(i);
+			free(hdr);
+		}
+	}
+
+	return;
+}
+
+void __nbio_bufpoolkill(nbio_t *nb)
+{
+
+	if (!nb->bufpool)
+		return;
+
+	trim(nb->bufpool, 0);
+
+	free(nb->bufpool);
+	nb->bufpool = NULL;
+
+	return;
+}
+
+unsigned char *nbio_bufget(nbio_t *nb, int len)
+{
+	struct nbio__bufpool *bp;
+	union bufhdr *hdr;
+	int class;
+
+	if (!nb || !nb->bufpool || (len < 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	bp = nb->bufpool;
+
+	for (class = 0; (class < NBIO_BUFPOOL_CLASSES) && (classsize(class) < (size_t)len); class++)
+		;
+
+	if (class == NBIO_BUFPOOL_CLASSES) {
+		if (!(hdr = malloc(sizeof(union bufhdr) + len))) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		class = -1;
+	} else if ((hdr = bp->freelists[class])) {
+		bp->freelists[class] = hdr->h.next;
+		bp->cached -= classsize(class);
+	} else if (!(hdr = malloc(sizeof(union bufhdr) + classsize(class)))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	hdr->h.next = NULL;
+	hdr->h.refs = 1;
+	hdr->h.class = class;
+
+	return (unsigned char *)(hdr + 1);
+}
+
+int nbio_bufref(nbio_t *nb, unsigned char *buf)
+{
+
+	if (!nb || !buf) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	BUFHDR(buf)->h.refs++;
+
+	return 0;
+}
+
+int nbio_bufrelease(nbio_t *nb, unsigned char *buf)
+{
+	struct nbio__bufpool *bp;
+	union bufhdr *hdr;
+
+	if (!nb || !nb->bufpool || !buf) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bp = nb->bufpool;
+	hdr = BUFHDR(buf);
+
+	if (--hdr->h.refs > 0)
+		return 0;
+
+	if ((hdr->h.class == -1) ||
+			(bp->cached + classsize(hdr->h.class) > bp->max)) {
+		free(hdr);
+		return 0;
+	}
+
+	hdr->h.next = bp->freelists[hdr->h.class];
+	bp->freelists[hdr->h.class] = hdr;
+	bp->cached += classsize(hdr->h.class);
+
+	return 0;
+}
+
+int nbio_setbufpoolmax(nbio_t *nb, int bytes)
+{
+
+	if (!nb || !nb->bufpool || (bytes < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nb->bufpool->max = bytes;
+	trim(nb->bufpool, nb->bufpool->max);
+
+	return 0;
+}
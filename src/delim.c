@@ -0,0 +1,251 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Delimiter matching for streamread_delim.
+ *
+ * Every time the delimiter list changes, it's compiled down to the set of
+ * bytes that delimiters can end with.  Scanning only has to find those
+ * bytes; anything it finds is then checked against the delimiters that
+ * end with it.  The usual line delimiters ("\n", "\r\n", "\r\n\r\n") all
+ * end in the same byte, so that's just memchr().  For a few different
+ * final bytes there are SSE2 and AVX2 scanners, picked at run time, and
+ * a lookup table for everything else.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NBIO_DELIM_X86
+#include <immintrin.h>
+#endif
+
+#include <libnbio.h>
+#include "impl.h"
+
+/* the most distinct final bytes the vector scanners handle */
+#define NBIO_DELIM_VECMAX 4
+
+struct nbio__delimset {
+	const unsigned char *(*find)(const struct nbio__delimset *ds, const unsigned char *p, const unsigned char *end);
+	int nlast;
+	unsigned char last[NBIO_DELIM_VECMAX];
+	unsigned char islast[256];
+};
+
+static const unsigned char *find_memchr(const struct nbio__delimset *ds, const unsigned char *p, const unsigned char *end)
+{
+	return memchr(p, ds->last[0], end - p);
+}
+
+static const unsigned char *find_table(const struct nbio__delimset *ds, const unsigned char *p, const unsigned char *end)
+{
+
+	for (; p < end; p++) {
+		if (ds->islast[*p])
+			return p;
+	}
+
+	return NULL;
+}
+
+#ifdef NBIO_DELIM_X86
+
+static int ctz(unsigned int v)
+{
+	return __builtin_ctz(v);
+}
+
+__attribute__((target("sse2")))
+static const unsigned char *find_sse2(const struct nbio__delimset *ds, const unsigned char *p, const unsigned char *end)
+{
+	__m128i want[NBIO_DELIM_VECMAX];
+	int i;
+
+	for (i = 0; i < ds->nlast; i++)
+		want[i] = _mm_set1_epi8((char)ds->last[i]);
+
+	for (; end - p >= 16; p += 16) {
+		__m128i chunk, hit;
+		unsigned int mask;
+
+		chunk = _mm_loadu_si128((const __m128i *)p);
+		hit = _mm_cmpeq_epi8(chunk, want[0]);
+		for (i = 1; i < ds->nlast; i++)
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(chunk, want[i]));
+
+		if ((mask = (unsigned int)_mm_movemask_epi8(hit)))
+			return p + ctz(mask);
+	}
+
+	return find_table(ds, p, end);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *find_avx2(const struct nbio__delimset *ds, const unsigned char *p, const unsigned char *end)
+{
+	__m256i want[NBIO_DELIM_VECMAX];
+	int i;
+
+	for (i = 0; i < ds->nlast; i++)
+		want[i] = _mm256_set1_epi8((char)ds->last[i]);
+
+	for (; end - p >= 32; p += 32) {
+		__m256i chunk, hit;
+		unsigned int mask;
+
+		chunk = _mm256_loadu_si256((const __m256i *)p);
+		hit = _mm256_cmpeq_epi8(chunk, want[0]);
+		for (i = 1; i < ds->nlast; i++)
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, want[i]));
+
+		if ((mask = (unsigned int)_mm256_movemask_epi8(hit)))
+			return p + ctz(mask);
+	}
+
+	return find_table(ds, p, end);
+}
+
+#endif /* def NBIO_DELIM_X86 */
+
+int __fdt_delimcompile(nbio_fd_t *fdt)
+{
+	struct nbio__delimset *ds;
+	nbio_delim_t *cd;
+
+	__fdt_delimfree(fdt);
+
+	if (!fdt->delims)
+		return 0;
+
+	if (!(ds = __nbio_slaballoc((nbio_t *)fdt->nb, sizeof(struct nbio__delimset)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(ds, 0, sizeof(struct nbio__delimset));
+
+	for (cd = fdt->delims; cd; cd = cd->next) {
+		unsigned char c = cd->data[cd->len-1];
+
+		if (ds->islast[c])
+			continue;
+
+		if (ds->nlast < NBIO_DELIM_VECMAX)
+			ds->last[ds->nlast] = c;
+		ds->nlast++;
+		ds->islast[c] = 1;
+	}
+
+	if (ds->nlast == 1)
+		ds->find = find_memchr;
+	else if (ds->nlast > NBIO_DELIM_VECMAX)
+		ds->find = find_table;
+#ifdef NBIO_DELIM_X86
+	else if (__builtin_cpu_supports("avx2"))
+		ds->find = find_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		ds->find = find_sse2;
+#endif
+	else
+		ds->find = find_table;
+
+	fdt->delimset = ds;
+
+	return 0;
+}
+
+void __fdt_delimfree(nbio_fd_t *fdt)
+{
+
+	__nbio_slabfree((nbio_t *)fdt->nb, fdt->delimset, sizeof(struct nbio__delimset));
+	fdt->delimset = NULL;
+
+	return;
+}
+
+/*
+ * Does cd end at buf[i], once everything up to and including it has been
+ * appended to cur?  The delimiter may start in the bytes that are already
+ * in cur.
+ */
+static int delimendsat(nbio_buf_t *cur, nbio_delim_t *cd, const unsigned char *buf, int i)
+{
+	int end, k;
+
+	end = cur->offset + i + 1;
+	if (end < cd->len)
+		return 0;
+
+	for (k = 0; k < cd->len; k++) {
+		int p = end - cd->len + k;
+
+		if (((p < cur->offset) ? cur->data[p] : buf[p - cur->offset]) != cd->data[k])
+			return 0;
+	}
+
+	return 1;
+}
+
+int __fdt_delimscan(nbio_fd_t *fdt, nbio_buf_t *cur, const unsigned char *buf, int n, nbio_delim_t **match)
+{
+	const struct nbio__delimset *ds = fdt->delimset;
+	const unsigned char *p, *end = buf + n;
+
+	*match = NULL;
+
+	if (!ds)
+		return n;
+
+	for (p = buf; (p < end) && (p = ds->find(ds, p, end)); p++) {
+		nbio_delim_t *cd;
+
+		/* When several end here, the first one in the list wins */
+		for (cd = fdt->delims; cd; cd = cd->next) {
+			if ((cd->data[cd->len-1] == *p) &&
+					delimendsat(cur, cd, buf, p - buf)) {
+				*match = cd;
+				return p - buf;
+			}
+		}
+	}
+
+	return n;
+}
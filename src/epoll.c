@@ -0,0 +1,340 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Linux epoll(7) support.
+ *
+ * Unlike poll(), the kernel keeps the interest set for us, so the only
+ * work done per pass is proportional to the number of fds that are
+ * actually ready.  Interest changes are pushed to the kernel as they
+ * happen (fdt_setpollin/out), but only when the mask really changes.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && !defined(NBIO_USE_WINSOCK2)
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <sys/epoll.h>
+
+#include <libnbio.h>
+#include "impl.h"
+
+/* nbio_t->intdata */
+struct epnbdata {
+	int epfd;
+	struct epoll_event *events;
+	int eventslen;
+};
+
+/* nbio_fd_t->intdata */
+struct epfdtdata {
+	unsigned int events; /* what we want */
+	unsigned int regevents; /* what the kernel currently has */
+	nbio_sockfd_t regfd; /* -1 if not registered */
+};
+
+static int epctl(nbio_t *nb, nbio_fd_t *fdt, int op)
+{
+	struct epnbdata *end = (struct epnbdata *)nb->intdata;
+	struct epfdtdata *data = (struct epfdtdata *)fdt->intdata;
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = data->events;
+	ev.data.ptr = (void *)fdt;
+
+	if (epoll_ctl(end->epfd, op, fdt->fd, &ev) == -1) {
+
+		/*
+		 * The same fd can show up twice: fdt_connect() hands its
+		 * socket over to a new fdt before the old one is closed.
+		 */
+		if ((op == EPOLL_CTL_ADD) && (errno == EEXIST))
+			return epctl(nb, fdt, EPOLL_CTL_MOD);
+
+		return -1;
+	}
+
+	data->regevents = data->events;
+
+	return 0;
+}
+
+static void epupdate(nbio_t *nb, nbio_fd_t *fdt)
+{
+	struct epfdtdata *data = (struct epfdtdata *)fdt->intdata;
+
+	if (data->regfd == -1)
+		return; /* pfdaddfinish will take care of it */
+
+	if (data->events == data->regevents)
+		return;
+
+	epctl(nb, fdt, EPOLL_CTL_MOD);
+
+	return;
+}
+
+static void ep_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
+{
+	struct epfdtdata *data = (struct epfdtdata *)fdt->intdata;
+
+	if (val)
+		data->events |= EPOLLIN;
+	else
+		data->events &= ~EPOLLIN;
+
+	epupdate(nb, fdt);
+
+	return;
+}
+
+static void ep_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
+{
+	struct epfdtdata *data = (struct epfdtdata *)fdt->intdata;
+
+	if (val)
+		data->events |= EPOLLOUT;
+	else
+		data->events &= ~EPOLLOUT;
+
+	epupdate(nb, fdt);
+
+	return;
+}
+
+static void ep_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
+{
+	struct epfdtdata *data = (struct epfdtdata *)fdt->intdata;
+
+	data->events = 0;
+
+	epupdate(nb, fdt);
+
+	return;
+}
+
+static int ep_setedge(nbio_t *nb, nbio_fd_t *fdt, int val)
+{
+	struct epfdtdata *data = (struct epfdtdata *)fdt->intdata;
+	int want = 0;
+
+	/* Going back, the caller sets up the level-triggered interest itself */
+	if (!val) {
+		data->events = 0;
+		return 0;
+	}
+
+	if (data->events & EPOLLIN)
+		want |= NBIO_READY_IN;
+	if (data->events & EPOLLOUT)
+		want |= NBIO_READY_OUT;
+
+	data->events = EPOLLIN | EPOLLOUT | EPOLLET;
+
+	if ((data->regfd != -1) && (epctl(nb, fdt, EPOLL_CTL_MOD) == -1)) {
+		data->events = data->regevents;
+		return -1;
+	}
+
+	return want;
+}
+
+static int ep_pfdadd(nbio_t *nb, nbio_fd_t *newfd)
+{
+	struct epfdtdata *data;
+
+	if (!(data = __nbio_slaballoc(nb, sizeof(struct epfdtdata))))
+		return -1;
+	memset(data, 0, sizeof(struct epfdtdata));
+	newfd->intdata = (void *)data;
+
+	data->regfd = -1;
+
+	return 0;
+}
+
+static void ep_pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
+{
+	struct epfdtdata *data = (struct epfdtdata *)newfd->intdata;
+
+	if (epctl(nb, newfd, EPOLL_CTL_ADD) == 0)
+		data->regfd = newfd->fd;
+
+	return;
+}
+
+static void ep_pfdrem(nbio_t *nb, nbio_fd_t *fdt)
+{
+	struct epnbdata *end = (struct epnbdata *)nb->intdata;
+	struct epfdtdata *data = (struct epfdtdata *)fdt->intdata;
+	struct epoll_event ev;
+
+	if (!data || (data->regfd == -1))
+		return;
+
+	/*
+	 * If the fd was handed off to another fdt, the registration now
+	 * belongs to that one.
+	 */
+	if ((fdt->fd == data->regfd) || !nbio_getfdt(nb, data->regfd))
+		epoll_ctl(end->epfd, EPOLL_CTL_DEL, data->regfd, &ev);
+
+	data->regfd = -1;
+
+	return;
+}
+
+static void ep_pfdfree(nbio_fd_t *fdt)
+{
+	struct epfdtdata *data = (struct epfdtdata *)fdt->intdata;
+
+	__nbio_slabfree((nbio_t *)fdt->nb, data, sizeof(struct epfdtdata));
+	fdt->intdata = NULL;
+
+	return;
+}
+
+static int ep_pfdinit(nbio_t *nb, int pfdsize)
+{
+	struct epnbdata *end;
+
+	if (!(end = nb->intdata = malloc(sizeof(struct epnbdata))))
+		return -1;
+
+	end->eventslen = pfdsize;
+	if (!(end->events = malloc(sizeof(struct epoll_event) * end->eventslen))) {
+		free(end);
+		nb->intdata = NULL;
+		return -1;
+	}
+
+	if ((end->epfd = epoll_create(pfdsize)) == -1) {
+		int sav;
+
+		sav = errno;
+		free(end->events);
+		free(end);
+		nb->intdata = NULL;
+		errno = sav;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ep_pfdkill(nbio_t *nb)
+{
+	struct epnbdata *end = (struct epnbdata *)nb->intdata;
+
+	close(end->epfd);
+	free(end->events);
+	free(end);
+
+	nb->intdata = NULL;
+
+	return;
+}
+
+static int ep_pfdpoll(nbio_t *nb, int timeout)
+{
+	struct epnbdata *end;
+	int epret, i;
+
+	if (!nb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	end = (struct epnbdata *)nb->intdata;
+
+	errno = 0;
+	if ((epret = epoll_wait(end->epfd, end->events, end->eventslen, __nbio_polltimeout(nb, timeout))) == -1) {
+
+		/* Never return EINTR from nbio_poll... */
+		if (errno == EINTR) {
+			errno = 0;
+			return 0;
+		}
+
+		return -1;
+	}
+
+	for (i = 0; i < epret; i++) {
+		nbio_fd_t *fdt = (nbio_fd_t *)end->events[i].data.ptr;
+		unsigned int revents = end->events[i].events;
+		int events = 0;
+
+		if (revents & EPOLLIN)
+			events |= NBIO_READY_IN;
+		if (revents & EPOLLOUT)
+			events |= NBIO_READY_OUT;
+		if (revents & (EPOLLERR | EPOLLHUP))
+			events |= NBIO_READY_EOF;
+
+		if (fdt->flags & NBIO_FDT_FLAG_EDGE)
+			__fdt_queueedge(nb, fdt, events);
+		else
+			__fdt_queueready(nb, fdt, events);
+	}
+
+	if (__nbio_dispatch(nb) == -1)
+		return -1;
+
+	return epret;
+}
+
+const struct nbio__backend __nbio_backend_epoll = {
+	NBIO_BACKEND_EPOLL, "epoll",
+	ep_pfdinit, ep_pfdkill,
+	ep_pfdadd, ep_pfdaddfinish, ep_pfdrem, ep_pfdfree,
+	ep_pfdpoll,
+	ep_setpollin, ep_setpollout, ep_setpollnone,
+	ep_setedge,
+	NULL, NULL
+};
+
+#endif /* def HAVE_SYS_EPOLL_H && !def NBIO_USE_WINSOCK2 */
@@ -21,14 +21,29 @@
 
 /* Common API */
 
+/* one piece of a scattered read or gathered write */
+typedef struct {
+	void *data;
+	int len;
+} fdt_iovec_t;
+
+/* most buffers fdt_readv/fdt_writev take at once */
+#define NBIO_IOV_MAX 64
+
+/* most bytes streamwrite gathers into one write */
+#define NBIO_TXIOV_BYTES 65536
+
 /* provided by implementation */
 nbio_sockfd_t fdt_newsocket(int family, int type);
 int fdt_connect(nbio_t *nb, const struct sockaddr *addr, int addrlen, nbio_handler_t handler, void *priv);
 int fdt_read(nbio_fd_t *fdt, void *buf, int count);
+int fdt_readv(nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt); /* at most NBIO_IOV_MAX */
 int fdt_write(nbio_fd_t *fdt, const void *buf, int count);
+int fdt_writev(nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt); /* same */
 void fdt_close(nbio_fd_t *fdt);
 int fdt_setnonblock(nbio_sockfd_t fd);
 nbio_sockfd_t fdt_acceptfd(nbio_sockfd_t fd, struct sockaddr *saret, int *salen);
+nbio_sockfd_t fdt_acceptnb(nbio_sockfd_t fd, struct sockaddr *saret, int *salen); /* non-blocking, close-on-exec */
 int fdt_bindfd(nbio_sockfd_t fd, struct sockaddr *sa, int salen);
 int fdt_listenfd(nbio_sockfd_t fd);
 int fdt_connectfd(nbio_sockfd_t fd, const struct sockaddr *addr, int addrlen);
@@ -37,42 +52,171 @@ int fdt_writefd(nbio_sockfd_t fd, const void *buf, int count);
 int fdt_closefd(nbio_sockfd_t fd);
 nbio_sockfd_t fdt_newlistener(const char *addr, unsigned short portnum);
 
-/* initialize nb */
-int pfdinit(nbio_t *nb, int pfdsize);
+/*
+ * A backend (the part that waits for the kernel to say which fds are
+ * ready).  nbio_init picks one, and the pfd and fdt_setpoll functions
+ * below are just calls through nb->backend.
+ */
+struct nbio__backend {
+	int id; /* NBIO_BACKEND_* */
+	const char *name; /* as in $NBIO_BACKEND */
+
+	/* initialize nb; clean up after itself on failure */
+	int (*init)(nbio_t *nb, int pfdsize);
+
+	/* free data in nb (not in fd) */
+	void (*kill)(nbio_t *nb);
+
+	/* new fd being added */
+	int (*add)(nbio_t *nb, nbio_fd_t *newfd);
+
+	/* after add, but before fd is added to fdlist; setpollin/out can be called before this */
+	void (*addfinish)(nbio_t *nb, nbio_fd_t *newfd);
+
+	/* removing fd from list (but not literally removed by this) */
+	void (*rem)(nbio_t *nb, nbio_fd_t *fdt);
+
+	/* called by __fdt_free */
+	void (*fdfree)(nbio_fd_t *fdt);
+
+	/* same as nbio_poll (timeout is in milliseconds) */
+	int (*poll)(nbio_t *nb, int timeout);
+
+	/* set what to poll */
+	void (*setpollin)(nbio_t *nb, nbio_fd_t *fdt, int val);
+	void (*setpollout)(nbio_t *nb, nbio_fd_t *fdt, int val);
+	void (*setpollnone)(nbio_t *nb, nbio_fd_t *fdt);
+
+	/*
+	 * Register fdt edge-triggered for both directions and return what it
+	 * was polling for (NBIO_READY_IN/OUT), or go back to level-triggered
+	 * with nothing polled for.  NULL if the backend can't.
+	 */
+	int (*setedge)(nbio_t *nb, nbio_fd_t *fdt, int val);
+
+	/*
+	 * The reads and writes streamread/streamwrite do, for a backend that
+	 * has the kernel do them itself.  Same returns as fdt_readv and
+	 * fdt_writev, which are used if these are NULL.
+	 */
+	int (*readv)(nbio_t *nb, nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt);
+	int (*writev)(nbio_t *nb, nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt);
+};
+
+#define pfdinit(nb, pfdsize) ((nb)->backend->init((nb), (pfdsize)))
+#define pfdkill(nb) ((nb)->backend->kill(nb))
+#define pfdadd(nb, newfd) ((nb)->backend->add((nb), (newfd)))
+#define pfdaddfinish(nb, newfd) ((nb)->backend->addfinish((nb), (newfd)))
+#define pfdrem(nb, fdt) ((nb)->backend->rem((nb), (fdt)))
+#define pfdfree(fdt) (((nbio_t *)(fdt)->nb)->backend->fdfree(fdt))
+#define pfdpoll(nb, timeout) ((nb)->backend->poll((nb), (timeout)))
+
+/* An edge-triggered fdt's interest set never changes, so those stay in libnbio.c */
+#define fdt_setpollin(nb, fdt, val) (((fdt)->flags & NBIO_FDT_FLAG_EDGE) ? \
+		__fdt_edgewant((nb), (fdt), NBIO_READY_IN, (val)) : \
+		(nb)->backend->setpollin((nb), (fdt), (val)))
+#define fdt_setpollout(nb, fdt, val) (((fdt)->flags & NBIO_FDT_FLAG_EDGE) ? \
+		__fdt_edgewant((nb), (fdt), NBIO_READY_OUT, (val)) : \
+		(nb)->backend->setpollout((nb), (fdt), (val)))
+#define fdt_setpollnone(nb, fdt) (((fdt)->flags & NBIO_FDT_FLAG_EDGE) ? \
+		__fdt_edgewant((nb), (fdt), NBIO_READY_IN | NBIO_READY_OUT, 0) : \
+		(nb)->backend->setpollnone((nb), (fdt)))
+
+/* the backends that can be built here, each in its own file */
+#ifdef NBIO_USE_WINSOCK2
+extern const struct nbio__backend __nbio_backend_wsk2;
+#else
+#ifdef HAVE_LINUX_IO_URING_H
+extern const struct nbio__backend __nbio_backend_uring;
+#endif
+#ifdef HAVE_SYS_EVENT_H
+extern const struct nbio__backend __nbio_backend_kqueue;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+extern const struct nbio__backend __nbio_backend_epoll;
+#endif
+#ifdef HAVE_SYS_POLL_H
+extern const struct nbio__backend __nbio_backend_poll;
+#endif
+extern const struct nbio__backend __nbio_backend_select;
+#endif
 
-/* free data in nb (not in fd) */
-void pfdkill(nbio_t *nb);
+/* provided by libnbio.c */
+void __fdt_free(nbio_fd_t *fdt);
 
-/* new fd being added */
-int pfdadd(nbio_t *nb, nbio_fd_t *newfd);
+/* disown fdt->fd without closing it (it may already belong to another fdt) */
+void __fdt_detachfd(nbio_t *nb, nbio_fd_t *fdt);
 
-/* after pfdadd, but before fd is added to fdlist; setpollin/out can be called before this */
-void pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd);
+/*
+ * provided by slab.c: small objects that live and die with connections.
+ * Give the same size back to __nbio_slabfree as was asked for.
+ */
+int __nbio_slabinit(nbio_t *nb);
+void __nbio_slabkill(nbio_t *nb);
+void *__nbio_slaballoc(nbio_t *nb, size_t size);
+void __nbio_slabfree(nbio_t *nb, void *p, size_t size);
 
-/* removing fd from list (but not literally removed by this) */
-void pfdrem(nbio_t *nb, nbio_fd_t *fdt);
+/* provided by bufpool.c */
+int __nbio_bufpoolinit(nbio_t *nb);
+void __nbio_bufpoolkill(nbio_t *nb);
 
-/* called by __fdt_free */
-void pfdfree(nbio_fd_t *fdt);
+/* nbio_buf_t->pooled: which pool buffers the library put on the rxchain */
+#define NBIO_BUF_RXPOOL 1 /* nbio_setrxpool() */
+#define NBIO_BUF_FRAME  2 /* a frame body */
 
-/* same as nbio_poll (timeout is in milliseconds) */
-int pfdpoll(nbio_t *nb, int timeout);
+/* provided by delim.c; rebuild/free fdt->delimset whenever fdt->delims changes */
+int __fdt_delimcompile(nbio_fd_t *fdt);
+void __fdt_delimfree(nbio_fd_t *fdt);
 
-/* set what to poll */
-void fdt_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val);
-void fdt_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val);
-void fdt_setpollnone(nbio_t *nb, nbio_fd_t *fdt);
+/*
+ * Index of the first of the n bytes in buf that completes a delimiter when
+ * appended to cur, or n if there isn't one.
+ */
+int __fdt_delimscan(nbio_fd_t *fdt, nbio_buf_t *cur, const unsigned char *buf, int n, nbio_delim_t **match);
 
-/* provided by libnbio.c */
-void __fdt_free(nbio_fd_t *fdt);
+/* how much streamread_delim reads from the socket at once */
+#define NBIO_RXSTAGE_LEN 4096
 
 /* call on applicable condition (break on -1) */
 int __fdt_ready_in(nbio_t *nb, nbio_fd_t *fdt);
 int __fdt_ready_out(nbio_t *nb, nbio_fd_t *fdt);
 int __fdt_ready_eof(nbio_t *nb, nbio_fd_t *fdt);
 
-/* call on every pass through pfdpoll (break on -1) */
-int __fdt_ready_all(nbio_t *nb, nbio_fd_t *fdt);
+/*
+ * Backends report what the kernel told them with __fdt_queueready(), then
+ * call __nbio_dispatch() once, which runs the __fdt_ready_*() functions in
+ * priority order and does the per-pass cleanups (break on -1).
+ */
+#define NBIO_READY_IN  0x0001
+#define NBIO_READY_OUT 0x0002
+#define NBIO_READY_EOF 0x0004
+#define NBIO_READY_TXMARK 0x0008 /* crossed a tx watermark (__fdt_txcheck) */
+void __fdt_queueready(nbio_t *nb, nbio_fd_t *fdt, int events);
+void __fdt_queueedge(nbio_t *nb, nbio_fd_t *fdt, int events); /* for NBIO_FDT_FLAG_EDGE fdts */
+void __fdt_edgewant(nbio_t *nb, nbio_fd_t *fdt, int events, int val);
+int __nbio_dispatch(nbio_t *nb);
+
+/* wake fdt for writing at when (nbio_addtxvector_time) */
+void __fdt_txwait(nbio_t *nb, nbio_fd_t *fdt, time_t when);
+
+/* timer.c */
+unsigned long long __nbio_clockms(void);
+unsigned long long __nbio_realtimems(void);
+void __nbio_clockupdate(nbio_t *nb); /* once a pass */
+int __nbio_timerinit(nbio_t *nb);
+void __nbio_timerkill(nbio_t *nb);
+void __nbio_timerdelfdt(nbio_t *nb, nbio_fd_t *fdt);
+int __nbio_timerrun(nbio_t *nb); /* break on -1 */
+int __nbio_timernext(nbio_t *nb); /* ms until a timer may be due, or -1 */
+
+/* call whenever fdt->txbytes changes */
+void __fdt_txcheck(nbio_t *nb, nbio_fd_t *fdt);
+
+/* call when the txchain may have emptied (queues the close-on-flush EOF) */
+void __fdt_flushcheck(nbio_t *nb, nbio_fd_t *fdt);
+
+/* the timeout pfdpoll should actually wait for */
+int __nbio_polltimeout(nbio_t *nb, int timeout);
 
 #endif /* __IMPL_H__ */
 
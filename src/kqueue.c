@@ -16,11 +16,24 @@
  * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+/*
+ * BSD kqueue(2) support.
+ *
+ * Each fdt gets a read and a write filter when it's added, and after that
+ * fdt_setpollin/out only enable or disable them.  Those changes go on a
+ * changelist that's handed to the kernel by the same kevent() call that
+ * waits, so changing interest costs no system calls of its own.
+ *
+ * Builds wherever <sys/event.h> is found, including Linux with libkqueue
+ * (see --with-libkqueue).
+ *
+ */
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
-#ifdef NBIO_USE_KQUEUE
+#if defined(HAVE_SYS_EVENT_H) && !defined(NBIO_USE_WINSOCK2)
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -30,128 +43,284 @@
 #include <sys/types.h>
 #endif
 
-#ifdef HAVE_SYS_SOCKET_H
-#include <sys/socket.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
 #endif
 
-#include <stdlib.h>
+#ifdef HAVE_ERRNO_H
 #include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
 
-#include <sys/types.h>
 #include <sys/event.h>
 
 #include <libnbio.h>
 #include "impl.h"
 
-static struct kevent *getnextchange(nbio_t *nb)
-{
-	struct kevent *ret = NULL;
+#define NBIO_KQ_MINCHANGES 64
 
-	if (nb->kqchangecount >= nb->kqchangeslen)
-		return NULL;
+/* nbio_t->intdata */
+struct kqnbdata {
+	int kq;
+	struct kevent *events;
+	int eventslen;
+	struct kevent *changes; /* not yet seen by the kernel */
+	int changeslen;
+	int changecount;
+};
 
-	ret = nb->kqchanges+nb->kqchangecount;
-	nb->kqchangecount++;
+#define KQ_READ  0x01
+#define KQ_WRITE 0x02
 
-	return ret;
-}
+/* nbio_fd_t->intdata */
+struct kqfdtdata {
+	int want; /* KQ_READ/KQ_WRITE, as of the end of the changelist */
+	nbio_sockfd_t regfd; /* -1 if not registered */
+};
 
 /*
- * XXX this API generates superfluous calls to kevent...
- * should make use of kevent's changelist functionality.
+ * Hand the changelist to the kernel without waiting.  Only needed when
+ * it can't grow any more.
  */
-static void fdt_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
+static int flushchanges(struct kqnbdata *knd)
 {
+
+	if (kevent(knd->kq, knd->changes, knd->changecount, NULL, 0, NULL) == -1)
+		return -1;
+
+	knd->changecount = 0;
+
+	return 0;
+}
+
+static int addchange(nbio_t *nb, nbio_sockfd_t fd, short filter, unsigned short flags, void *udata)
+{
+	struct kqnbdata *knd = (struct kqnbdata *)nb->intdata;
 	struct kevent *kev;
 
-	if (!nb || !fdt)
-		return;
+	if (knd->changecount >= knd->changeslen) {
+		struct kevent *nc;
 
-	if (!(kev = getnextchange(nb))) {
-		fprintf(stderr, "libnbio: fdt_setpollin: getnextchange failed!\n");
-		return;
+		if ((nc = realloc(knd->changes, sizeof(struct kevent) * knd->changeslen * 2))) {
+			knd->changes = nc;
+			knd->changeslen *= 2;
+		} else if (flushchanges(knd) == -1)
+			return -1;
 	}
 
-	kev->ident = fdt->fd;
-	kev->filter = EVFILT_READ;
-	kev->flags = val ? EV_ADD : EV_DELETE;
-	kev->fflags = 0;
-	kev->udata = (void *)fdt;
+	kev = knd->changes + knd->changecount++;
+	EV_SET(kev, fd, filter, flags, 0, 0, udata);
+
+	return 0;
+}
+
+/*
+ * Drop anything still queued for this fdt.  Its fd may be closed (and
+ * its knotes with it) or belong to someone else by the time the
+ * changelist goes in.
+ */
+static void purgechanges(nbio_t *nb, nbio_fd_t *fdt)
+{
+	struct kqnbdata *knd = (struct kqnbdata *)nb->intdata;
+	int i, j;
+
+	for (i = j = 0; i < knd->changecount; i++) {
+		if ((void *)knd->changes[i].udata == (void *)fdt)
+			continue;
+		if (i != j)
+			knd->changes[j] = knd->changes[i];
+		j++;
+	}
+	knd->changecount = j;
 
 	return;
 }
 
-static void fdt_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
+static void kqupdate(nbio_t *nb, nbio_fd_t *fdt, int want)
 {
-	struct kevent *kev;
+	struct kqfdtdata *data = (struct kqfdtdata *)fdt->intdata;
+	int diff;
 
-	if (!nb || !fdt)
-		return;
+	diff = data->want ^ want;
+	data->want = want;
 
-	if (!(kev = getnextchange(nb))) {
-		fprintf(stderr, "libnbio: fdt_setpollout: getnextchange failed!\n");
-		return;
-	}
+	if (data->regfd == -1)
+		return; /* pfdaddfinish will take care of it */
 
-	kev->ident = fdt->fd;
-	kev->filter = EVFILT_WRITE;
-	kev->flags = val ? EV_ADD : EV_DELETE;
-	kev->fflags = 0;
-	kev->udata = (void *)fdt;
+	if (diff & KQ_READ)
+		addchange(nb, fdt->fd, EVFILT_READ, (want & KQ_READ) ? EV_ENABLE : EV_DISABLE, (void *)fdt);
+	if (diff & KQ_WRITE)
+		addchange(nb, fdt->fd, EVFILT_WRITE, (want & KQ_WRITE) ? EV_ENABLE : EV_DISABLE, (void *)fdt);
 
 	return;
 }
 
-static void fdt_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
+/* (Re)create both filters, enabled according to want */
+static void kqregister(nbio_t *nb, nbio_fd_t *fdt, unsigned short flags)
 {
-	if (!nb || !fdt)
-		return;
+	struct kqfdtdata *data = (struct kqfdtdata *)fdt->intdata;
 
-	fdt_setpollin(nb, fdt, 0);
-	fdt_setpollout(nb, fdt, 0);
+	addchange(nb, fdt->fd, EVFILT_READ, EV_ADD | flags | ((data->want & KQ_READ) ? EV_ENABLE : EV_DISABLE), (void *)fdt);
+	addchange(nb, fdt->fd, EVFILT_WRITE, EV_ADD | flags | ((data->want & KQ_WRITE) ? EV_ENABLE : EV_DISABLE), (void *)fdt);
 
 	return;
 }
 
-int pfdadd(nbio_t *nb, nbio_fd_t *newfd)
+static void kq_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
 {
-	return 0; /* not used for kqueue */
+	struct kqfdtdata *data = (struct kqfdtdata *)fdt->intdata;
+
+	kqupdate(nb, fdt, val ? (data->want | KQ_READ) : (data->want & ~KQ_READ));
+
+	return;
 }
 
-void pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
+static void kq_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
 {
-	return; /* not used for kqueue */
+	struct kqfdtdata *data = (struct kqfdtdata *)fdt->intdata;
+
+	kqupdate(nb, fdt, val ? (data->want | KQ_WRITE) : (data->want & ~KQ_WRITE));
+
+	return;
 }
 
-void pfdfree(nbio_fd_t *fdt)
+static void kq_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
 {
-	return; /* not used */
+
+	kqupdate(nb, fdt, 0);
+
+	return;
 }
 
-int pfdinit(nbio_t *nb, int pfdsize)
+/*
+ * EV_CLEAR can only be set when a knote is created, so both filters are
+ * deleted and added again, either way.
+ */
+static int kq_setedge(nbio_t *nb, nbio_fd_t *fdt, int val)
+{
+	struct kqfdtdata *data = (struct kqfdtdata *)fdt->intdata;
+	int want = 0;
+
+	if (val) {
+		if (data->want & KQ_READ)
+			want |= NBIO_READY_IN;
+		if (data->want & KQ_WRITE)
+			want |= NBIO_READY_OUT;
+		data->want = KQ_READ | KQ_WRITE;
+	} else
+		data->want = 0; /* the caller sets up the level-triggered interest itself */
+
+	if (data->regfd == -1)
+		return want;
+
+	addchange(nb, fdt->fd, EVFILT_READ, EV_DELETE, (void *)fdt);
+	addchange(nb, fdt->fd, EVFILT_WRITE, EV_DELETE, (void *)fdt);
+	kqregister(nb, fdt, val ? EV_CLEAR : 0);
+
+	return want;
+}
+
+static int kq_pfdadd(nbio_t *nb, nbio_fd_t *newfd)
 {
+	struct kqfdtdata *data;
 
-	if (!nb || (pfdsize <= 0))
+	if (!(data = __nbio_slaballoc(nb, sizeof(struct kqfdtdata))))
 		return -1;
+	memset(data, 0, sizeof(struct kqfdtdata));
+	newfd->intdata = (void *)data;
+
+	data->regfd = -1;
+
+	return 0;
+}
+
+static void kq_pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
+{
+	struct kqfdtdata *data = (struct kqfdtdata *)newfd->intdata;
+
+	/*
+	 * EV_ADD on a knote that's already there just updates it, which
+	 * also moves the udata over when fdt_connect() hands its socket
+	 * to a new fdt.
+	 */
+	kqregister(nb, newfd, 0);
+	data->regfd = newfd->fd;
+
+	return;
+}
+
+static void kq_pfdrem(nbio_t *nb, nbio_fd_t *fdt)
+{
+	struct kqnbdata *knd = (struct kqnbdata *)nb->intdata;
+	struct kqfdtdata *data = (struct kqfdtdata *)fdt->intdata;
+	struct kevent dels[2];
+
+	if (!data || (data->regfd == -1))
+		return;
+
+	purgechanges(nb, fdt);
+
+	/*
+	 * Closing the fd gets rid of its knotes.  If it was detached
+	 * instead, they have to go now, unless the fd was handed off to
+	 * another fdt, in which case they're that one's.
+	 */
+	if ((fdt->fd != data->regfd) && !nbio_getfdt(nb, data->regfd)) {
+		EV_SET(&dels[0], data->regfd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		EV_SET(&dels[1], data->regfd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(knd->kq, dels, 2, NULL, 0, NULL);
+	}
+
+	data->regfd = -1;
+
+	return;
+}
+
+static void kq_pfdfree(nbio_fd_t *fdt)
+{
+	struct kqfdtdata *data = (struct kqfdtdata *)fdt->intdata;
+
+	__nbio_slabfree((nbio_t *)fdt->nb, data, sizeof(struct kqfdtdata));
+	fdt->intdata = NULL;
 
-	nb->kqeventslen = pfdsize;
-	nb->kqchangeslen = pfdsize*2;
+	return;
+}
 
-	if (!(nb->kqevents = malloc(sizeof(struct kevent)*nb->kqeventslen)))
+static int kq_pfdinit(nbio_t *nb, int pfdsize)
+{
+	struct kqnbdata *knd;
+
+	if (!(knd = nb->intdata = malloc(sizeof(struct kqnbdata))))
 		return -1;
-	if (!(nb->kqchanges = malloc(sizeof(struct kevent)*nb->kqchangeslen))) {
-		free(nb->kqevents);
+	memset(knd, 0, sizeof(struct kqnbdata));
+
+	knd->eventslen = pfdsize;
+	knd->changeslen = (pfdsize * 2 > NBIO_KQ_MINCHANGES) ? pfdsize * 2 : NBIO_KQ_MINCHANGES;
+
+	if (!(knd->events = malloc(sizeof(struct kevent) * knd->eventslen)) ||
+			!(knd->changes = malloc(sizeof(struct kevent) * knd->changeslen))) {
+		free(knd->events);
+		free(knd);
+		nb->intdata = NULL;
+		errno = ENOMEM;
 		return -1;
 	}
 
-	nb->kqchangecount = 0;
-
-	if ((nb->kq = kqueue()) == -1) {
+	if ((knd->kq = kqueue()) == -1) {
 		int sav;
 
 		sav = errno;
-		free(nb->kqevents);
-		free(nb->kqchanges);
+		free(knd->changes);
+		free(knd->events);
+		free(knd);
+		nb->intdata = NULL;
 		errno = sav;
 
 		return -1;
@@ -160,95 +329,100 @@ int pfdinit(nbio_t *nb, int pfdsize)
 	return 0;
 }
 
-void pfdkill(nbio_t *nb)
+static void kq_pfdkill(nbio_t *nb)
 {
+	struct kqnbdata *knd = (struct kqnbdata *)nb->intdata;
 
-	/* XXX I guess... the inverse of kqueue() isn't documented... */
-	close(nb->kq);
-
-	free(nb->kqevents);
-	nb->kqeventslen = 0;
+	close(knd->kq);
+	free(knd->changes);
+	free(knd->events);
+	free(knd);
 
-	free(nb->kqchanges);
-	nb->kqchangeslen = 0;
-	nb->kqchangecount = 0;
+	nb->intdata = NULL;
 
 	return;
 }
 
-int pfdpoll(nbio_t *nb, int timeout)
+static int kq_pfdpoll(nbio_t *nb, int timeout)
 {
+	struct kqnbdata *knd;
 	struct timespec to;
 	int kevret, i;
-	nbio_fd_t *fdt;
 
 	if (!nb) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (timeout > 0) {
-		to.tv_sec = 0;
-		to.tv_nsec = timeout*1000;
+	knd = (struct kqnbdata *)nb->intdata;
+
+	if ((timeout = __nbio_polltimeout(nb, timeout)) >= 0) {
+		to.tv_sec = timeout / 1000;
+		to.tv_nsec = (timeout % 1000) * 1000000;
 	}
 
 	errno = 0;
+	if ((kevret = kevent(knd->kq, knd->changes, knd->changecount, knd->events, knd->eventslen, (timeout >= 0) ? &to : NULL)) == -1) {
+
+		/* Never return EINTR from nbio_poll... */
+		if (errno == EINTR) {
+			errno = 0;
+			return 0;
+		}
 
-	if ((kevret = kevent(nb->kq, nb->kqchanges, nb->kqchangecount, nb->kqevents, nb->kqeventslen, (timeout > 0)?&to:NULL)) == -1) {
-		perror("kevent");
 		return -1;
 	}
 
 	/* As long as it doesn't return -1, the changelist has been processed */
-	nb->kqchangecount = 0;
-
-	if (kevret == 0)
-		return 0;
+	knd->changecount = 0;
 
 	for (i = 0; i < kevret; i++) {
+		struct kevent *kev = knd->events + i;
+		nbio_fd_t *fdt = (nbio_fd_t *)kev->udata;
+		int events = 0;
 
-		if (!nb->kqevents[i].udata) {
-			fprintf(stderr, "no udata!\n");
+		if (!fdt)
 			continue;
-		}
 
-		fdt = (nbio_fd_t *)nb->kqevents[i].udata;
-
-		if (nb->kqevents[i].filter == EVFILT_READ) {
-
-			if (fdt->type == NBIO_FDTYPE_LISTENER) {
-				if (fdt->handler(nb, NBIO_EVENT_READ, fdt) == -1)
-					return -1;
-			} else if (fdt->type == NBIO_FDTYPE_STREAM) {
-				if (streamread(nb, fdt) == -1)
-					return -1;
-			} else if (fdt->type == NBIO_FDTYPE_DGRAM) {
-				if (dgramread(nb, fdt) == -1)
-					return -1;
-			}
-
-		} else if (nb->kqevents[i].filter == EVFILT_WRITE) {
-
-			if (fdt->type == NBIO_FDTYPE_LISTENER)
-				; /* invalid */
-			else if (fdt->type == NBIO_FDTYPE_STREAM) {
-				if (streamwrite(nb, fdt) == -1)
-					return -1;
-			} else if (fdt->type == NBIO_FDTYPE_DGRAM) {
-				if (dgramwrite(nb, fdt) == -1)
-					return -1;
-			}
-		}
+		if (kev->flags & EV_ERROR) {
 
-		if (nb->kqevents[i].flags & EV_EOF) {
-			if (fdt->handler(nb, NBIO_EVENT_EOF, fdt) == -1)
-				return -1;
-		}
+			/* Deleting a filter that was never added is harmless */
+			if (kev->data == ENOENT)
+				continue;
+
+			events |= NBIO_READY_EOF;
+
+		} else if (kev->filter == EVFILT_READ) {
 
+			events |= NBIO_READY_IN;
+
+			/* Only once whatever's left has been read */
+			if ((kev->flags & EV_EOF) && (kev->data == 0))
+				events |= NBIO_READY_EOF;
+
+		} else if (kev->filter == EVFILT_WRITE)
+			events |= NBIO_READY_OUT;
+
+		if (fdt->flags & NBIO_FDT_FLAG_EDGE)
+			__fdt_queueedge(nb, fdt, events);
+		else
+			__fdt_queueready(nb, fdt, events);
 	}
 
-	return nbio_cleanuponly(nb);
-}
+	if (__nbio_dispatch(nb) == -1)
+		return -1;
 
-#endif /* def NBIO_USE_KQUEUE */
+	return kevret;
+}
 
+const struct nbio__backend __nbio_backend_kqueue = {
+	NBIO_BACKEND_KQUEUE, "kqueue",
+	kq_pfdinit, kq_pfdkill,
+	kq_pfdadd, kq_pfdaddfinish, kq_pfdrem, kq_pfdfree,
+	kq_pfdpoll,
+	kq_setpollin, kq_setpollout, kq_setpollnone,
+	kq_setedge,
+	NULL, NULL
+};
+
+#endif /* def HAVE_SYS_EVENT_H && !def NBIO_USE_WINSOCK2 */
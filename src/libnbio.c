@@ -41,20 +41,66 @@
 #include "resolv.h"
 
 
-/* XXX this should be elimitated by using more bookkeeping */
-static void setmaxpri(nbio_t *nb)
+/* one of these per priority level, in nb->pris */
+struct nbio__prilevel {
+	int count; /* open fdts at this priority */
+	nbio_fd_t *readyhead, *readytail;
+	int readycount;
+};
+
+static void priref(nbio_t *nb, int pri)
 {
+
+	nb->pris[pri].count++;
+
+	if (pri > nb->maxpri)
+		nb->maxpri = pri;
+
+	return;
+}
+
+/*
+ * Nothing open is left at this level, and the dispatcher won't look at
+ * it once maxpri is below it, so empty its ready queue: closed fdts come
+ * off (so they can be freed), and any that nbio_setpri() moved go to
+ * their new level.
+ */
+static void prisweep(nbio_t *nb, int pri)
+{
+	struct nbio__prilevel *pl = nb->pris + pri;
 	nbio_fd_t *cur;
-	int max = 0;
+	int revents;
 
-	for (cur = (nbio_fd_t *)nb->fdlist; cur; cur = cur->next) {
-		if (cur->flags & NBIO_FDT_FLAG_CLOSED)
-			continue;
-		if (cur->pri > max)
-			max = cur->pri;
+	while ((cur = pl->readyhead)) {
+		pl->readyhead = cur->readynext;
+		pl->readycount--;
+		nb->readycount--;
+
+		revents = cur->revents;
+		cur->revents = 0;
+		cur->readynext = NULL;
+
+		__fdt_queueready(nb, cur, revents); /* not if it's closed */
 	}
+	pl->readytail = NULL;
+
+	return;
+}
+
+/*
+ * Only walks down when the top level empties out, and then only over
+ * priority levels (and anything still queued on them), never over all
+ * the fdts.
+ */
+static void priunref(nbio_t *nb, int pri)
+{
+
+	nb->pris[pri].count--;
 
-	nb->maxpri = max;
+	while ((nb->maxpri > 0) && !nb->pris[nb->maxpri].count) {
+		prisweep(nb, nb->maxpri);
+		nb->maxpri--;
+	}
 
 	return;
 }
@@ -67,12 +113,67 @@ int nbio_settimer(nbio_t *nb, nbio_fd_t *fdt, int interval)
 		return -1;
 	}
 
-	fdt->timerinterval = interval;
-	fdt->timernextfire = time(NULL) + interval;
+	if (fdt->timer) {
+		nbio_deltimer(nb, fdt->timer);
+		fdt->timer = NULL;
+	}
+
+	if (interval && !(fdt->timer = nbio_addtimer(nb, fdt, interval * 1000, interval * 1000, NULL, NULL)))
+		return -1;
 
 	return 0;
 }
 
+/*
+ * Streams with only delayed tx buffers left don't poll for writing; they
+ * sleep on a timer until the first one is due.
+ */
+static int txwakeup(nbio_t *nb, nbio_timer_t *timer, void *udata)
+{
+	nbio_fd_t *fdt = (nbio_fd_t *)udata;
+
+	fdt->txtimer = NULL;
+	fdt->txwake = 0;
+
+	fdt_setpollout(nb, fdt, 1);
+
+	return 0;
+}
+
+/* Longer waits are cut short and looked at again, in case the wall clock moved */
+#define NBIO_TXWAIT_MAXMS (3600 * 1000)
+
+void __fdt_txwait(nbio_t *nb, nbio_fd_t *fdt, time_t when)
+{
+	unsigned long long nowms, whenms;
+	int ms;
+
+	if (fdt->flags & NBIO_FDT_FLAG_CLOSED)
+		return;
+
+	if (fdt->txtimer && (fdt->txwake <= when))
+		return; /* already waking up sooner */
+
+	if (fdt->txtimer)
+		nbio_deltimer(nb, fdt->txtimer);
+
+	/* Not from nb->now, which is truncated and would wake up to a second late */
+	nowms = __nbio_realtimems();
+	whenms = (when > 0) ? (unsigned long long)when * 1000 : 0;
+	if (whenms <= nowms)
+		ms = 0;
+	else if (whenms - nowms > NBIO_TXWAIT_MAXMS)
+		ms = NBIO_TXWAIT_MAXMS;
+	else
+		ms = (int)(whenms - nowms);
+
+	fdt->txwake = when;
+	if (!(fdt->txtimer = nbio_addtimer(nb, fdt, ms, 0, txwakeup, fdt)))
+		fdt_setpollout(nb, fdt, 1); /* the old way, then */
+
+	return;
+}
+
 /* Since this skips INTERNAL, it is useful only for outside callers. */
 nbio_fd_t *nbio_iter(nbio_t *nb, int (*matcher)(nbio_t *nb, void *ud, nbio_fd_t *fdt), void *userdata)
 {
@@ -98,15 +199,32 @@ nbio_fd_t *nbio_iter(nbio_t *nb, int (*matcher)(nbio_t *nb, void *ud, nbio_fd_t
 	return NULL;
 }
 
-nbio_fd_t *nbio_getfdt(nbio_t *nb, nbio_sockfd_t fd)
+#ifdef NBIO_USE_WINSOCK2
+
+/*
+ * A SOCKET is a handle, not a small dense number, so it can't index a
+ * table; fdts are looked up on the list, as they always were.
+ */
+static int fdtabreserve(nbio_t *nb, nbio_sockfd_t fd)
 {
-	nbio_fd_t *cur;
+	return 0;
+}
 
-	if (!nb) {
-		errno = EINVAL;
-		return NULL;
-	}
+static void fdtabset(nbio_t *nb, nbio_fd_t *fdt)
+{
+	return;
+}
+
+static void fdtabdel(nbio_t *nb, nbio_fd_t *fdt)
+{
+	return;
+}
+
+static nbio_fd_t *fdtabget(nbio_t *nb, nbio_sockfd_t fd)
+{
+	nbio_fd_t *cur;
 
+	/* newest first, so a socket fdt_connect handed over finds the new fdt */
 	for (cur = (nbio_fd_t *)nb->fdlist; cur; cur = cur->next) {
 		if (cur->flags & NBIO_FDT_FLAG_IGNORE)
 			continue;
@@ -114,161 +232,825 @@ nbio_fd_t *nbio_getfdt(nbio_t *nb, nbio_sockfd_t fd)
 			return cur;
 	}
 
-	errno = ENOENT;
 	return NULL;
 }
 
-static int streamread_nodelim(nbio_t *nb, nbio_fd_t *fdt)
+#else
+
+/* Past any sane descriptor limit; anything higher is refused, not indexed */
+#define NBIO_FDTAB_MAX (1 << 24)
+
+/*
+ * nb->fdtab maps each fd to the fdt that currently owns it.  When fdt_connect
+ * hands its socket over, the new fdt simply takes over the slot.
+ */
+static int fdtabreserve(nbio_t *nb, nbio_sockfd_t fd)
 {
-	nbio_buf_t *cur;
-	int target, got;
+	nbio_fd_t **newtab;
+	int newsize;
 
-	for (cur = fdt->rxchain; cur; cur = cur->next) {
-		/* Find a non-zero buffer that still has space left in it */
-		if (cur->len && (cur->offset < cur->len))
-			break;
+	if ((fd < 0) || (fd >= NBIO_FDTAB_MAX)) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	if (!cur) {
-		fdt_setpollin(nb, fdt, 0);
+	if (fd < nb->fdtabsize)
 		return 0;
+
+	for (newsize = nb->fdtabsize; fd >= newsize; )
+		newsize *= 2;
+
+	if (!(newtab = realloc(nb->fdtab, sizeof(nbio_fd_t *) * newsize))) {
+		errno = ENOMEM;
+		return -1;
 	}
+	memset(newtab + nb->fdtabsize, 0, sizeof(nbio_fd_t *) * (newsize - nb->fdtabsize));
 
-	target = cur->len - cur->offset;
+	nb->fdtab = newtab;
+	nb->fdtabsize = newsize;
 
-	/* XXX should allow methods to override -- ie, WSARecv on win32 */
-	if (((got = fdt_read(fdt, cur->data+cur->offset, target)) < 0) && (errno != EINTR) && (errno != EAGAIN)) {
-		return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
+	return 0;
+}
+
+/* Only after fdtabreserve() */
+static void fdtabset(nbio_t *nb, nbio_fd_t *fdt)
+{
+
+	nb->fdtab[fdt->fd] = fdt;
+
+	return;
+}
+
+static void fdtabdel(nbio_t *nb, nbio_fd_t *fdt)
+{
+
+	if ((fdt->fd < 0) || (fdt->fd >= nb->fdtabsize))
+		return;
+
+	if (nb->fdtab[fdt->fd] == fdt)
+		nb->fdtab[fdt->fd] = NULL;
+
+	return;
+}
+
+static nbio_fd_t *fdtabget(nbio_t *nb, nbio_sockfd_t fd)
+{
+	nbio_fd_t *cur;
+
+	if ((fd < 0) || (fd >= nb->fdtabsize))
+		return NULL;
+
+	if ((cur = nb->fdtab[fd]) && !(cur->flags & NBIO_FDT_FLAG_IGNORE))
+		return cur;
+
+	return NULL;
+}
+
+#endif /* def NBIO_USE_WINSOCK2 */
+
+void __fdt_detachfd(nbio_t *nb, nbio_fd_t *fdt)
+{
+
+	fdtabdel(nb, fdt);
+	fdt->fd = -1;
+
+	return;
+}
+
+nbio_fd_t *nbio_getfdt(nbio_t *nb, nbio_sockfd_t fd)
+{
+	nbio_fd_t *cur;
+
+	if (!nb) {
+		errno = EINVAL;
+		return NULL;
 	}
 
-	if (got == 0)
-		return fdt->handler(nb, NBIO_EVENT_EOF, fdt);
+	if ((cur = fdtabget(nb, fd)))
+		return cur;
 
-	if (got < 0)
-		got = 0; /* a non-fatal error occured; zero bytes actually read */
+	errno = ENOENT;
+	return NULL;
+}
+
+/*
+ * The stream read paths use these, so that an edge-triggered fdt knows
+ * when it has been drained (see nbio_setedge), and so that a backend
+ * that reads for itself (io_uring) can hand over what it got.
+ */
+static int sockread(nbio_fd_t *fdt, void *buf, int count)
+{
+	nbio_t *nb = (nbio_t *)fdt->nb;
+	int rr;
+
+	if (nb->backend->readv) {
+		fdt_iovec_t iov;
+
+		iov.data = buf;
+		iov.len = count;
+		rr = nb->backend->readv(nb, fdt, &iov, 1);
+	} else
+		rr = fdt_read(fdt, buf, count);
+
+	if ((rr == 0) || ((rr < 0) && (errno == EAGAIN)))
+		fdt->edgeready &= ~NBIO_READY_IN;
+
+	return rr;
+}
+
+static int sockreadv(nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt)
+{
+	nbio_t *nb = (nbio_t *)fdt->nb;
+	int rr;
+
+	if (nb->backend->readv)
+		rr = nb->backend->readv(nb, fdt, iov, iovcnt);
+	else
+		rr = fdt_readv(fdt, iov, iovcnt);
 
-	cur->offset += got;
+	if ((rr == 0) || ((rr < 0) && (errno == EAGAIN)))
+		fdt->edgeready &= ~NBIO_READY_IN;
 
-	if (cur->offset >= cur->len)
-		return fdt->handler(nb, NBIO_EVENT_READ, fdt);
+	return rr;
+}
+
+/*
+ * Move as much of the staging buffer into cur as will fit (no more than
+ * max bytes).  Returns the number of bytes moved.
+ */
+static int unstage(nbio_fd_t *fdt, nbio_buf_t *cur, int max)
+{
+	int n;
+
+	n = cur->len - cur->offset;
+	if (n > fdt->rxstagelen)
+		n = fdt->rxstagelen;
+	if (n > max)
+		n = max;
+
+	memcpy(cur->data+cur->offset, fdt->rxstage+fdt->rxstageoff, n);
+	cur->offset += n;
+
+	fdt->rxstageoff += n;
+	if (!(fdt->rxstagelen -= n))
+		fdt->rxstageoff = 0;
 
-	return 0; /* don't call handler unless we filled a buffer */
+	return n;
 }
 
-static int streamread_delim(nbio_t *nb, nbio_fd_t *fdt)
+static int haverxspace(nbio_fd_t *fdt)
 {
 	nbio_buf_t *cur;
-	int got, rr, target;
 
-	rr = 0;
 	for (cur = fdt->rxchain; cur; cur = cur->next) {
-		/* Find a non-zero buffer that still has space left in it */
 		if (cur->len && (cur->offset < cur->len))
-			break;
+			return 1;
 	}
 
-	if (!cur) {
+	return 0;
+}
+
+/* Make sure there's a pool buffer to read into */
+static int rxpoolfill(nbio_t *nb, nbio_fd_t *fdt)
+{
+	nbio_buf_t *cur;
+	unsigned char *buf;
+
+	if (haverxspace(fdt))
+		return 0;
+
+	if (!(buf = nbio_bufget(nb, fdt->rxpoollen)))
+		return -1;
+
+	if (!(cur = nbio_addrxbuf(nb, fdt, buf, fdt->rxpoollen, 0, 0))) {
+		nbio_bufrelease(nb, buf);
+		return -1;
+	}
+
+	cur->pooled = NBIO_BUF_RXPOOL;
+
+	return 0;
+}
+
+/*
+ * Fills every non-full buffer in the rxchain with one scattered read, and
+ * calls the read callback once for each one that was filled.
+ */
+static int streamread_nodelim(nbio_t *nb, nbio_fd_t *fdt, int *got)
+{
+	nbio_buf_t *cur;
+	fdt_iovec_t iov[NBIO_IOV_MAX];
+	int iovcnt, rr, done;
+
+	*got = 0;
+
+	for (cur = fdt->rxchain, iovcnt = 0; cur && (iovcnt < NBIO_IOV_MAX); cur = cur->next) {
+		/* Find non-zero buffers that still have space left in them */
+		if (cur->len && (cur->offset < cur->len)) {
+			iov[iovcnt].data = cur->data+cur->offset;
+			iov[iovcnt].len = cur->len - cur->offset;
+			iovcnt++;
+		}
+	}
+
+	if (!iovcnt) {
 		fdt_setpollin(nb, fdt, 0);
 		return 0;
 	}
 
-	for (got = 0, target = 0; (got < (cur->len - cur->offset)) && !target; ) {
-		nbio_delim_t *cd;
+	if (fdt->rxstagelen) {
+
+		/* Leftovers from delimited reads come before anything on the socket */
+		for (cur = fdt->rxchain, done = 0; cur && fdt->rxstagelen; cur = cur->next) {
+			if (cur->len && (cur->offset < cur->len)) {
+				unstage(fdt, cur, fdt->rxstagelen);
+				if (cur->offset >= cur->len)
+					done++;
+			}
+		}
+
+		if (fdt->rxstagelen)
+			__fdt_queueready(nb, fdt, NBIO_READY_IN);
+
+	} else {
+
+		if (iovcnt == 1)
+			rr = sockread(fdt, iov[0].data, iov[0].len);
+		else
+			rr = sockreadv(fdt, iov, iovcnt);
+
+		if ((rr < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+			return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
+		}
+
+		if (rr == 0)
+			return fdt->handler(nb, NBIO_EVENT_EOF, fdt);
 
-		if ((rr = fdt_read(fdt, cur->data+cur->offset, 1)) <= 0)
+		if (rr < 0)
+			rr = 0; /* a non-fatal error occured; zero bytes actually read */
+
+		*got = rr;
+
+		for (cur = fdt->rxchain, done = 0; cur && rr; cur = cur->next) {
+			int n;
+
+			if (!cur->len || (cur->offset >= cur->len))
+				continue;
+
+			n = cur->len - cur->offset;
+			if (n > rr)
+				n = rr;
+
+			cur->offset += n;
+			rr -= n;
+
+			if (cur->offset >= cur->len)
+				done++;
+		}
+	}
+
+	/* don't call handler unless we filled a buffer */
+	while (done--) {
+		int ret;
+
+		if ((ret = fdt->handler(nb, NBIO_EVENT_READ, fdt)) < 0)
+			return ret;
+
+		if (fdt->flags & NBIO_FDT_FLAG_CLOSED)
 			break;
+	}
+
+	return 0;
+}
 
-		cur->offset += rr;
-		got += rr;
+/*
+ * The socket is read in bulk into fdt->rxstage, and from there copied
+ * into the rx buffers one record at a time.  Whatever follows the last
+ * delimiter stays staged for the next buffer (or for streamread_nodelim,
+ * if the handler switches modes).
+ */
+static int streamread_delim(nbio_t *nb, nbio_fd_t *fdt, int *got)
+{
+	nbio_buf_t *cur;
+	int rr;
 
-		for (cd = fdt->delims; cd; cd = cd->next) {
-			if ((cur->offset >= cd->len) &&
-				(memcmp(cur->data+cur->offset-cd->len,
-						cd->data, cd->len) == 0)) {
+	*got = 0;
 
-				target++;
+	for (;;) {
+		nbio_delim_t *cd;
+		int n;
 
-				if (!(fdt->flags & NBIO_FDT_FLAG_KEEPDELIM))
-					memset(cur->data+cur->offset-cd->len, '\0', cd->len);
+		for (cur = fdt->rxchain; cur; cur = cur->next) {
+			/* Find a non-zero buffer that still has space left in it */
+			if (cur->len && (cur->offset < cur->len))
 				break;
+		}
+
+		if (!cur) {
+
+			if (fdt->rxpoollen && (fdt->rxstagelen ||
+					!(fdt->flags & NBIO_FDT_FLAG_SHAREDRX))) {
+				if (rxpoolfill(nb, fdt) == -1)
+					return -1;
+				continue;
 			}
+
+			/* Shared reads attach a buffer once there's something for it */
+			if ((fdt->flags & NBIO_FDT_FLAG_SHAREDRX) && !fdt->rxstagelen)
+				return 0;
+
+			/* nbio_addrxvector will pick up anything still staged */
+			fdt_setpollin(nb, fdt, 0);
+			return 0;
 		}
 
+		if (!fdt->rxstagelen) {
+
+			/* One read per call; streamread decides whether to come back */
+			if (*got)
+				return 0;
+
+			if (!fdt->rxstage &&
+					!(fdt->rxstage = __nbio_slaballoc(nb, NBIO_RXSTAGE_LEN))) {
+				errno = ENOMEM;
+				return -1;
+			}
+
+			if ((rr = sockread(fdt, fdt->rxstage, NBIO_RXSTAGE_LEN)) < 0) {
+				if ((errno == EAGAIN) || (errno == EINTR))
+					return 0;
+				return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
+			}
+
+			if (rr == 0)
+				return fdt->handler(nb, NBIO_EVENT_EOF, fdt);
+
+			fdt->rxstageoff = 0;
+			fdt->rxstagelen = rr;
+			*got += rr;
+		}
+
+		n = cur->len - cur->offset;
+		if (n > fdt->rxstagelen)
+			n = fdt->rxstagelen;
+
+		n = __fdt_delimscan(fdt, cur, fdt->rxstage+fdt->rxstageoff, n, &cd);
+		if (cd)
+			n++; /* include the delimiter's last byte */
+
+		unstage(fdt, cur, n);
+
+		if (cd && !(fdt->flags & NBIO_FDT_FLAG_KEEPDELIM))
+			memset(cur->data+cur->offset-cd->len, '\0', cd->len);
+
+		if ((cur->offset >= cur->len) || cd) {
+			int ret;
+
+			if ((ret = fdt->handler(nb, NBIO_EVENT_READ, fdt)) < 0)
+				return ret;
+
+			if (fdt->flags & NBIO_FDT_FLAG_CLOSED)
+				return 0;
+		}
+
+		/* The handler may have changed how the rest should be read */
+		if (!fdt->delims || (fdt->flags & NBIO_FDT_FLAG_RAW) ||
+				(fdt->flags & NBIO_FDT_FLAG_RAWREAD)) {
+			if (fdt->rxstagelen)
+				__fdt_queueready(nb, fdt, NBIO_READY_IN);
+			return 0;
+		}
 	}
 
-	if ((rr < 0) && (errno != EAGAIN))
-		return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
+	return 0; /* not reached */
+}
 
-	if ((cur->offset >= cur->len) || target) {
-		if ((got = fdt->handler(nb, NBIO_EVENT_READ, fdt)) < 0)
-			return got;
+/*
+ * Parse a frame header from the staging buffer.  Returns the header's
+ * length, 0 if more bytes are needed, or -1 if it's bad.
+ */
+static int framehdr(nbio_fd_t *fdt, unsigned long *framelen)
+{
+	const unsigned char *p = fdt->rxstage+fdt->rxstageoff;
+	int n = fdt->rxstagelen, i;
+
+	if (fdt->framing == NBIO_FRAME_U16BE) {
+		if (n < 2)
+			return 0;
+		*framelen = ((unsigned long)p[0] << 8) | p[1];
+		return 2;
+	} else if (fdt->framing == NBIO_FRAME_U32BE) {
+		if (n < 4)
+			return 0;
+		*framelen = ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+				((unsigned long)p[2] << 8) | p[3];
+		return 4;
 	}
 
-	if (rr == 0)
-		return fdt->handler(nb, NBIO_EVENT_EOF, fdt);
+	/* NBIO_FRAME_VARINT: LEB128, at most 32 bits worth */
+	for (i = 0, *framelen = 0; i < n; i++) {
+		if (i == 5)
+			return -1;
+		*framelen |= (unsigned long)(p[i] & 0x7f) << (7 * i);
+		if (!(p[i] & 0x80))
+			return i + 1;
+	}
 
-	return 0; /* don't call handler unless we filled a buffer or got delim  */
+	return (n >= 5) ? -1 : 0;
 }
 
+/*
+ * Length-prefixed frames.  Headers come out of the staging buffer; the
+ * body goes into a pool buffer, which is put on the rxchain for the
+ * handler to take with nbio_remtoprxvector.  Large bodies are read
+ * straight into it.
+ */
+static int streamread_framed(nbio_t *nb, nbio_fd_t *fdt, int *got)
+{
+	nbio_buf_t *cur;
+	int rr;
+
+	*got = 0;
+
+	for (;;) {
+		unsigned long framelen;
+		unsigned char *buf;
+		int hdrlen;
+
+		for (cur = fdt->rxchain; cur; cur = cur->next) {
+			/* Find the frame that's still being read, if any */
+			if (cur->len && (cur->offset < cur->len))
+				break;
+		}
+
+		if (cur) {
+
+			if (fdt->rxstagelen)
+				unstage(fdt, cur, fdt->rxstagelen);
+			else if (*got)
+				return 0;
+			else {
+				if ((rr = sockread(fdt, cur->data+cur->offset, cur->len-cur->offset)) < 0) {
+					if ((errno == EAGAIN) || (errno == EINTR))
+						return 0;
+					return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
+				}
+
+				if (rr == 0)
+					return fdt->handler(nb, NBIO_EVENT_EOF, fdt);
+
+				cur->offset += rr;
+				*got += rr;
+			}
+
+		} else {
+
+			if ((hdrlen = framehdr(fdt, &framelen)) == -1) {
+				errno = EMSGSIZE;
+				return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
+			}
+
+			if (hdrlen == 0) {
+
+				if (*got)
+					return 0;
+
+				if (!fdt->rxstage &&
+						!(fdt->rxstage = __nbio_slaballoc(nb, NBIO_RXSTAGE_LEN))) {
+					errno = ENOMEM;
+					return -1;
+				}
+
+				/* keep the partial header, and read in after it */
+				if (fdt->rxstagelen)
+					memmove(fdt->rxstage, fdt->rxstage+fdt->rxstageoff, fdt->rxstagelen);
+				fdt->rxstageoff = 0;
+
+				if ((rr = sockread(fdt, fdt->rxstage+fdt->rxstagelen, NBIO_RXSTAGE_LEN-fdt->rxstagelen)) < 0) {
+					if ((errno == EAGAIN) || (errno == EINTR))
+						return 0;
+					return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
+				}
+
+				if (rr == 0)
+					return fdt->handler(nb, NBIO_EVENT_EOF, fdt);
+
+				fdt->rxstagelen += rr;
+				*got += rr;
+
+				continue;
+			}
+
+			if (framelen > (unsigned long)fdt->framemax) {
+				errno = EMSGSIZE;
+				return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
+			}
+
+			fdt->rxstageoff += hdrlen;
+			if (!(fdt->rxstagelen -= hdrlen))
+				fdt->rxstageoff = 0;
+
+			if (!(buf = nbio_bufget(nb, (int)framelen)))
+				return -1;
+
+			if (!(cur = nbio_addrxbuf(nb, fdt, buf, (int)framelen, 0, 0))) {
+				nbio_bufrelease(nb, buf);
+				return -1;
+			}
+			cur->pooled = NBIO_BUF_FRAME;
+
+			if (fdt->rxstagelen)
+				unstage(fdt, cur, fdt->rxstagelen);
+		}
+
+		if (cur->offset >= cur->len) {
+			int ret;
+
+			if ((ret = fdt->handler(nb, NBIO_EVENT_READ, fdt)) < 0)
+				return ret;
+
+			if (fdt->flags & NBIO_FDT_FLAG_CLOSED)
+				return 0;
+		}
+
+		/* The handler may have changed how the rest should be read */
+		if (!fdt->framing || (fdt->flags & NBIO_FDT_FLAG_RAW) ||
+				(fdt->flags & NBIO_FDT_FLAG_RAWREAD)) {
+			if (fdt->rxstagelen)
+				__fdt_queueready(nb, fdt, NBIO_READY_IN);
+			return 0;
+		}
+	}
+
+	return 0; /* not reached */
+}
+
+/*
+ * Shared reads (NBIO_FDT_FLAG_SHAREDRX).  Between reads, the stream has
+ * neither a staging buffer nor an rx buffer.  When it's readable, it's
+ * read into nb->rxscratch, which stands in as the staging buffer while
+ * the records in it are handed out.  Only then is an rx buffer attached,
+ * and only a partial record is copied out to a staging buffer of its own
+ * (sharedend).
+ *
+ * Returns 0 with *got set to 0 if there was nothing to read.
+ */
+static int sharedread(nbio_t *nb, nbio_fd_t *fdt, int *got)
+{
+	int rr;
+
+	*got = 0;
+
+	if (!nb->rxscratch && !(nb->rxscratch = malloc(NBIO_RXSTAGE_LEN))) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (!fdt->rxstagelen && (fdt->rxstage != nb->rxscratch)) {
+		__nbio_slabfree(nb, fdt->rxstage, NBIO_RXSTAGE_LEN);
+		fdt->rxstage = nb->rxscratch;
+		fdt->rxstageoff = 0;
+	}
+
+	/* Frames are read into the stage already, and their buffers come later */
+	if (fdt->framing)
+		return 0;
+
+	if (!fdt->rxstagelen && !haverxspace(fdt)) {
+
+		if ((rr = sockread(fdt, fdt->rxstage, NBIO_RXSTAGE_LEN)) < 0) {
+			if ((errno == EAGAIN) || (errno == EINTR))
+				return 0;
+			return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
+		}
+
+		if (rr == 0)
+			return fdt->handler(nb, NBIO_EVENT_EOF, fdt);
+
+		fdt->rxstageoff = 0;
+		fdt->rxstagelen = rr;
+		*got = rr;
+	}
+
+	if (!fdt->rxstagelen || haverxspace(fdt))
+		return 0;
+
+	/* Something to put in it now, so give it somewhere to go */
+	if (fdt->rxpoollen)
+		return rxpoolfill(nb, fdt);
+
+	return fdt->handler(nb, NBIO_EVENT_NEEDRXBUF, fdt);
+}
+
+/*
+ * Done reading for now: anything left in the scratch buffer gets copied
+ * to the fdt's own staging buffer, and (with a pool) any rx buffer that
+ * hasn't had anything read into it goes back.
+ */
+static int sharedend(nbio_t *nb, nbio_fd_t *fdt)
+{
+	nbio_buf_t *cur, *next;
+
+	if (fdt->rxstage && (fdt->rxstage == nb->rxscratch)) {
+
+		fdt->rxstage = NULL;
+
+		if (fdt->flags & NBIO_FDT_FLAG_CLOSED)
+			fdt->rxstagelen = 0;
+
+		if (fdt->rxstagelen) {
+			if (!(fdt->rxstage = __nbio_slaballoc(nb, NBIO_RXSTAGE_LEN))) {
+				fdt->rxstagelen = 0;
+				errno = ENOMEM;
+				return -1;
+			}
+			memcpy(fdt->rxstage, nb->rxscratch+fdt->rxstageoff, fdt->rxstagelen);
+		}
+		fdt->rxstageoff = 0;
+
+	} else if (fdt->rxstage && !fdt->rxstagelen &&
+			(fdt->flags & NBIO_FDT_FLAG_SHAREDRX)) {
+		__nbio_slabfree(nb, fdt->rxstage, NBIO_RXSTAGE_LEN);
+		fdt->rxstage = NULL;
+		fdt->rxstageoff = 0;
+	}
+
+	if (!(fdt->flags & NBIO_FDT_FLAG_SHAREDRX) || !fdt->rxpoollen ||
+			(fdt->flags & NBIO_FDT_FLAG_CLOSED))
+		return 0;
+
+	for (cur = fdt->rxchain; cur; cur = next) {
+		unsigned char *buf = cur->data;
+
+		next = cur->next;
+
+		if ((cur->pooled == NBIO_BUF_RXPOOL) && !cur->offset) {
+			nbio_remrxbuf(nb, fdt, cur);
+			nbio_bufrelease(nb, buf);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Normally there's one read per fdt per pass.  With a read budget, keep
+ * reading until the socket runs dry or the budget is spent; anything left
+ * over is still readable next pass, after everyone else has had a turn.
+ */
 static int streamread(nbio_t *nb, nbio_fd_t *fdt)
 {
+	int budget, total, got, sgot, ret;
+
+	budget = fdt->readbudget ? fdt->readbudget : nb->readbudget;
+
+	for (total = 0; ; total += got) {
+
+		if ((fdt->flags & NBIO_FDT_FLAG_RAW) ||
+				(fdt->flags & NBIO_FDT_FLAG_RAWREAD)) {
+			fdt->edgeready &= ~NBIO_READY_IN; /* it's the handler's to drain */
+			ret = fdt->handler(nb, NBIO_EVENT_READ, fdt);
+			break;
+		}
+
+		if (fdt->flags & NBIO_FDT_FLAG_SHAREDRX) {
 
-	if ((fdt->flags & NBIO_FDT_FLAG_RAW) ||
-			(fdt->flags & NBIO_FDT_FLAG_RAWREAD))
-		return fdt->handler(nb, NBIO_EVENT_READ, fdt);
+			if (((ret = sharedread(nb, fdt, &sgot)) < 0) ||
+					(fdt->flags & NBIO_FDT_FLAG_CLOSED))
+				break;
+
+			/* Nothing came in, and there's nowhere to put it anyway */
+			if (!fdt->framing && !fdt->rxstagelen && !haverxspace(fdt))
+				break;
+
+		} else {
 
-	if (fdt->delims)
-		return streamread_delim(nb, fdt);
+			sgot = 0;
+
+			if (fdt->rxpoollen && !fdt->framing && (rxpoolfill(nb, fdt) == -1)) {
+				ret = -1;
+				break;
+			}
+		}
 
-	return streamread_nodelim(nb, fdt);
+		if (fdt->framing)
+			ret = streamread_framed(nb, fdt, &got);
+		else if (fdt->delims)
+			ret = streamread_delim(nb, fdt, &got);
+		else
+			ret = streamread_nodelim(nb, fdt, &got);
+
+		if (ret < 0)
+			break;
+
+		got += sgot;
+
+		/* Nowhere to put the rest until the application adds a buffer */
+		if ((fdt->flags & NBIO_FDT_FLAG_SHAREDRX) && !fdt->framing &&
+				fdt->rxstagelen && !haverxspace(fdt))
+			break;
+
+		if (!got || (fdt->flags & NBIO_FDT_FLAG_CLOSED) ||
+				(total + got >= budget))
+			break;
+	}
+
+	if ((sharedend(nb, fdt) == -1) && (ret >= 0))
+		ret = -1;
+
+	return ret;
 }
 
+/*
+ * Everything in the txchain that's due goes out in one gathered write
+ * (up to NBIO_IOV_MAX buffers or NBIO_TXIOV_BYTES).  The write callback
+ * is still called once for each buffer that was finished.
+ */
 static int streamwrite(nbio_t *nb, nbio_fd_t *fdt)
 {
 	nbio_buf_t *cur;
-	int target, wrote;
-	int pollout = 0;
-	time_t now;
+	fdt_iovec_t iov[NBIO_IOV_MAX];
+	int iovcnt, bytes, wrote, done;
+	time_t now, wake = 0;
 
-	if (fdt->flags & NBIO_FDT_FLAG_RAW)
+	if (fdt->flags & NBIO_FDT_FLAG_RAW) {
+		fdt->edgeready &= ~NBIO_READY_OUT; /* it's the handler's to drain */
 		return fdt->handler(nb, NBIO_EVENT_WRITE, fdt);
+	}
 
-	now = time(NULL);
+	now = nb->now;
 
-	for (cur = fdt->txchain; cur; cur = cur->next) {
-		/* Find a non-zero buffer that still needs data written
+	for (cur = fdt->txchain, iovcnt = 0, bytes = 0;
+			cur && (iovcnt < NBIO_IOV_MAX) && (bytes < NBIO_TXIOV_BYTES);
+			cur = cur->next) {
+		/* Find non-zero buffers that still need data written
 			also checks for the trigger time */
 		if (cur->len && (cur->offset < cur->len)) {
-			if (cur->trigger <= now)
-				break;
-			else
-				pollout = 1; /* keep checking on this fd */
+			if (cur->trigger <= now) {
+				iov[iovcnt].data = cur->data+cur->offset;
+				iov[iovcnt].len = cur->len - cur->offset;
+				bytes += iov[iovcnt].len;
+				iovcnt++;
+			} else if (!wake || (cur->trigger < wake))
+				wake = cur->trigger;
 		}
 	}
 
-	if (!cur) {
-		fdt_setpollout(nb, fdt, pollout);
+	if (!iovcnt) {
+		/* Sleep until the first delayed buffer is due */
+		fdt_setpollout(nb, fdt, 0);
+		if (wake)
+			__fdt_txwait(nb, fdt, wake);
 		return 0; /* nothing to do */
 	}
 
-	target = cur->len - cur->offset;
+	if (nb->backend->writev)
+		wrote = nb->backend->writev(nb, fdt, iov, iovcnt);
+	else if (iovcnt == 1)
+		wrote = fdt_write(fdt, iov[0].data, iov[0].len);
+	else
+		wrote = fdt_writev(fdt, iov, iovcnt);
+
+	/* A short write means the socket buffer is full */
+	if ((wrote < 0) ? (errno == EAGAIN) : (wrote < bytes))
+		fdt->edgeready &= ~NBIO_READY_OUT;
 
-	if (((wrote = fdt_write(fdt, cur->data+cur->offset, target)) < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+	if ((wrote < 0) && (errno != EINTR) && (errno != EAGAIN)) {
 		return fdt->handler(nb, NBIO_EVENT_ERROR, fdt);
 	}
 
 	if (wrote < 0)
 		wrote = 0; /* a non-fatal error occured; zero bytes actually written */
 
-	cur->offset += wrote;
+	/* Spread it back over the same buffers, in the same order */
+	for (cur = fdt->txchain, done = 0; cur && wrote; cur = cur->next) {
+		int n;
 
-	if (cur->offset >= cur->len) {
-		int ret;
+		if (!cur->len || (cur->offset >= cur->len) || (cur->trigger > now))
+			continue;
+
+		n = cur->len - cur->offset;
+		if (n > wrote)
+			n = wrote;
+
+		cur->offset += n;
+		wrote -= n;
+		fdt->txbytes -= n;
 
-		ret = fdt->handler(nb, NBIO_EVENT_WRITE, fdt);
+		if (cur->offset >= cur->len)
+			done++;
+	}
+
+	__fdt_txcheck(nb, fdt);
 
-		if (!fdt->txchain && (fdt->flags & NBIO_FDT_FLAG_CLOSEONFLUSH))
-			ret = fdt->handler(nb, NBIO_EVENT_EOF, fdt);
+	if (done) {
+		int ret = 0;
+
+		/* The callbacks take the buffers off the chain, so no walking it here */
+		while (done-- && !(fdt->flags & NBIO_FDT_FLAG_CLOSED)) {
+			if ((ret = fdt->handler(nb, NBIO_EVENT_WRITE, fdt)) < 0)
+				return ret;
+		}
 
 		return ret;
 	}
@@ -289,30 +1071,267 @@ static int dgramwrite(nbio_t *nb, nbio_fd_t *fdt)
 	return fdt->handler(nb, NBIO_EVENT_WRITE, fdt);
 }
 
-int nbio_init(nbio_t *nb, int pfdsize)
+static int prigrow(nbio_t *nb, int pri)
 {
+	struct nbio__prilevel *newpris;
+
+	if (pri < nb->prislen)
+		return 0;
+
+	if (pri > NBIO_PRI_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(newpris = realloc(nb->pris, sizeof(struct nbio__prilevel) * (pri + 1)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(newpris + nb->prislen, 0, sizeof(struct nbio__prilevel) * (pri + 1 - nb->prislen));
+
+	nb->pris = newpris;
+	nb->prislen = pri + 1;
+
+	return 0;
+}
+
+/* The order AUTO falls back in, fastest first */
+static const struct nbio__backend *backends[] = {
+#ifdef NBIO_USE_WINSOCK2
+	&__nbio_backend_wsk2,
+#else
+#ifdef HAVE_LINUX_IO_URING_H
+	&__nbio_backend_uring,
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+	&__nbio_backend_epoll,
+#endif
+#ifdef HAVE_SYS_EVENT_H
+	&__nbio_backend_kqueue, /* after epoll: on Linux, that's libkqueue */
+#endif
+#ifdef HAVE_SYS_POLL_H
+	&__nbio_backend_poll,
+#endif
+	&__nbio_backend_select,
+#endif
+	NULL
+};
+
+/* What configure asked for, which AUTO tries first */
+#if defined(NBIO_USE_WINSOCK2)
+#define NBIO_BACKEND_DEFAULT NBIO_BACKEND_WINSOCK2
+#elif defined(NBIO_USE_URING)
+#define NBIO_BACKEND_DEFAULT NBIO_BACKEND_URING
+#elif defined(NBIO_USE_KQUEUE)
+#define NBIO_BACKEND_DEFAULT NBIO_BACKEND_KQUEUE
+#elif defined(NBIO_USE_SELECT)
+#define NBIO_BACKEND_DEFAULT NBIO_BACKEND_SELECT
+#elif defined(NBIO_USE_EPOLL)
+#define NBIO_BACKEND_DEFAULT NBIO_BACKEND_EPOLL
+#elif defined(HAVE_SYS_POLL_H)
+#define NBIO_BACKEND_DEFAULT NBIO_BACKEND_POLL
+#else
+#define NBIO_BACKEND_DEFAULT NBIO_BACKEND_SELECT
+#endif
+
+static const struct nbio__backend *findbackend(int id)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (backends[i]->id == id)
+			return backends[i];
+	}
+
+	return NULL;
+}
+
+/* Every backend there is, built in here or not */
+static const struct {
+	const char *name;
+	int id;
+} backendnames[] = {
+	{ "auto", NBIO_BACKEND_AUTO },
+	{ "poll", NBIO_BACKEND_POLL },
+	{ "select", NBIO_BACKEND_SELECT },
+	{ "epoll", NBIO_BACKEND_EPOLL },
+	{ "kqueue", NBIO_BACKEND_KQUEUE },
+	{ "uring", NBIO_BACKEND_URING },
+	{ "winsock2", NBIO_BACKEND_WINSOCK2 },
+	{ NULL, 0 }
+};
+
+/*
+ * $NBIO_BACKEND overrides what the program asked for.  A name we've never
+ * heard of is an error; one that isn't built in (or won't start) fails
+ * in backendinit, rather than quietly running on something else.
+ */
+static int envbackend(int *backend)
+{
+	const char *env;
+	int i;
+
+	if (!(env = getenv("NBIO_BACKEND")) || !*env)
+		return 0;
+
+	for (i = 0; backendnames[i].name; i++) {
+		if (strcmp(env, backendnames[i].name) == 0) {
+			*backend = backendnames[i].id;
+			return 0;
+		}
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static int backendinit(nbio_t *nb, int pfdsize, int backend)
+{
+	int i;
+
+	if (backend != NBIO_BACKEND_AUTO) {
+		if (!(nb->backend = findbackend(backend))) {
+			errno = ENOSYS;
+			return -1;
+		}
+		return pfdinit(nb, pfdsize);
+	}
+
+	if ((nb->backend = findbackend(NBIO_BACKEND_DEFAULT)) &&
+			(pfdinit(nb, pfdsize) == 0))
+		return 0;
+
+	for (i = 0; backends[i]; i++) {
+		if (backends[i]->id == NBIO_BACKEND_DEFAULT)
+			continue;
+
+		nb->backend = backends[i];
+		if (pfdinit(nb, pfdsize) == 0)
+			return 0;
+	}
+
+	nb->backend = NULL;
+
+	return -1;
+}
+
+int nbio_init_ex(nbio_t *nb, int pfdsize, int backend)
+{
+
+	int sav;
 
 	if (!nb || (pfdsize <= 0))
 		return -1;
 
+	if (envbackend(&backend) == -1)
+		return -1;
+
 	memset(nb, 0, sizeof(nbio_t));
 
-	if (nbio_resolv__init(nb) == -1)
+	nb->fdtabsize = pfdsize;
+	if (!(nb->fdtab = calloc(nb->fdtabsize, sizeof(nbio_fd_t *))))
 		return -1;
 
-	if (pfdinit(nb, pfdsize) == -1) {
-		nbio_resolv__free(nb);
+	if (prigrow(nb, 0) == -1) {
+		free(nb->fdtab);
 		return -1;
 	}
 
-	setmaxpri(nb);
+	if (__nbio_slabinit(nb) == -1) {
+		free(nb->pris);
+		free(nb->fdtab);
+		return -1;
+	}
+
+	if (__nbio_bufpoolinit(nb) == -1) {
+		__nbio_slabkill(nb);
+		free(nb->pris);
+		free(nb->fdtab);
+		return -1;
+	}
+
+	__nbio_clockupdate(nb);
+
+	if (__nbio_timerinit(nb) == -1) {
+		__nbio_bufpoolkill(nb);
+		__nbio_slabkill(nb);
+		free(nb->pris);
+		free(nb->fdtab);
+		return -1;
+	}
+
+	if (nbio_resolv__init(nb) == -1) {
+		__nbio_timerkill(nb);
+		__nbio_bufpoolkill(nb);
+		__nbio_slabkill(nb);
+		free(nb->pris);
+		free(nb->fdtab);
+		return -1;
+	}
+
+	if (backendinit(nb, pfdsize, backend) == -1) {
+		sav = errno;
+		nbio_resolv__free(nb);
+		__nbio_timerkill(nb);
+		__nbio_bufpoolkill(nb);
+		__nbio_slabkill(nb);
+		free(nb->pris);
+		free(nb->fdtab);
+		errno = sav;
+		return -1;
+	}
 
 	return 0;
 }
 
+int nbio_init(nbio_t *nb, int pfdsize)
+{
+	return nbio_init_ex(nb, pfdsize, NBIO_BACKEND_AUTO);
+}
+
+int nbio_getbackend(nbio_t *nb)
+{
+
+	if (!nb || !nb->backend) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return nb->backend->id;
+}
+
+/* Free what was closed; idle connections cost nothing here */
+static void freeclosed(nbio_t *nb)
+{
+	nbio_fd_t *cur, **prev;
+
+	for (prev = &nb->closed; (cur = *prev); ) {
+
+		/* still sitting in a ready queue; freed after it's dispatched */
+		if (cur->revents) {
+			prev = &cur->closednext;
+			continue;
+		}
+
+		*prev = cur->closednext;
+
+		if (cur->prev)
+			cur->prev->next = cur->next;
+		else
+			nb->fdlist = (void *)cur->next;
+		if (cur->next)
+			cur->next->prev = cur->prev;
+
+		__fdt_free(cur);
+	}
+
+	return;
+}
+
 int nbio_kill(nbio_t *nb)
 {
 	nbio_fd_t *cur;
+	int i;
 
 	if (!nb) {
 		errno = EINVAL;
@@ -322,36 +1341,81 @@ int nbio_kill(nbio_t *nb)
 	for (cur = (nbio_fd_t *)nb->fdlist; cur; cur = cur->next)
 		nbio_closefdt(nb, cur);
 
-	nbio_cleanuponly(nb); /* to clean up the list */
+	/* nothing left to dispatch to */
+	for (i = 0; i < nb->prislen; i++) {
+		while ((cur = nb->pris[i].readyhead)) {
+			nb->pris[i].readyhead = cur->readynext;
+			cur->readynext = NULL;
+			cur->revents = 0;
+		}
+		nb->pris[i].readytail = NULL;
+		nb->pris[i].readycount = 0;
+	}
+	nb->readycount = 0;
+
+	freeclosed(nb); /* to clean up the list */
 
 	pfdkill(nb);
 
 	nbio_resolv__free(nb);
 
+	__nbio_timerkill(nb);
+
+	__nbio_bufpoolkill(nb);
+
+	/* last, since pfdkill may still be giving things back */
+	__nbio_slabkill(nb);
+
+	free(nb->pris);
+	nb->pris = NULL;
+	nb->prislen = 0;
+
+	free(nb->fdtab);
+	nb->fdtab = NULL;
+	nb->fdtabsize = 0;
+
+	free(nb->rxscratch);
+	nb->rxscratch = NULL;
+
 	return 0;
 }
 
-/* XXX handle malloc==NULL case better here */
-static int preallocchains(nbio_fd_t *fdt, int rxlen, int txlen)
+static void freechain(nbio_t *nb, nbio_buf_t *buf)
+{
+	nbio_buf_t *tmp;
+
+	while (buf) {
+		tmp = buf;
+		buf = buf->next;
+		__nbio_slabfree(nb, tmp, sizeof(nbio_buf_t));
+	}
+
+	return;
+}
+
+/* on failure, the caller gives back whatever did get allocated */
+static int preallocchains(nbio_t *nb, nbio_fd_t *fdt, int rxlen, int txlen)
 {
 	nbio_buf_t *newbuf;
 
 	while (rxlen) {
-		if (!(newbuf = malloc(sizeof(nbio_buf_t))))
+		if (!(newbuf = __nbio_slaballoc(nb, sizeof(nbio_buf_t))))
 			return -1;
 
 		newbuf->next = fdt->rxchain_freelist;
 		fdt->rxchain_freelist = newbuf;
+		fdt->rxfree++;
 
 		rxlen--;
 	}
 
 	while (txlen) {
-		if (!(newbuf = malloc(sizeof(nbio_buf_t))))
+		if (!(newbuf = __nbio_slaballoc(nb, sizeof(nbio_buf_t))))
 			return -1;
 
 		newbuf->next = fdt->txchain_freelist;
 		fdt->txchain_freelist = newbuf;
+		fdt->txfree++;
 
 		txlen--;
 	}
@@ -362,12 +1426,16 @@ static int preallocchains(nbio_fd_t *fdt, int rxlen, int txlen)
 nbio_fd_t *nbio_addfd(nbio_t *nb, int type, nbio_sockfd_t fd, int pri, nbio_handler_t handler, void *priv, int rxlen, int txlen)
 {
 	nbio_fd_t *newfd;
+	int nonblock;
 
 	if (!nb || (pri < 0) || (rxlen < 0) || (txlen < 0)) {
 		errno = EINVAL;
 		return NULL;
 	}
 
+	nonblock = type & NBIO_FDTYPE_FLAG_NONBLOCK;
+	type &= ~NBIO_FDTYPE_FLAG_NONBLOCK;
+
 	if ((type != NBIO_FDTYPE_STREAM) &&
 			(type != NBIO_FDTYPE_LISTENER) &&
 			(type != NBIO_FDTYPE_DGRAM)) {
@@ -380,32 +1448,55 @@ nbio_fd_t *nbio_addfd(nbio_t *nb, int type, nbio_sockfd_t fd, int pri, nbio_hand
 		return NULL;
 	}
 
-	if (fdt_setnonblock(fd) == -1)
+	if (fdtabreserve(nb, fd) == -1)
+		return NULL;
+
+	if (prigrow(nb, pri) == -1)
 		return NULL;
 
-	if (!(newfd = malloc(sizeof(nbio_fd_t)))) {
+	if (!nonblock && (fdt_setnonblock(fd) == -1))
+		return NULL;
+
+	if (!(newfd = __nbio_slaballoc(nb, sizeof(nbio_fd_t)))) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
+	newfd->nb = (void *)nb;
 	newfd->type = type;
 	newfd->fd = fd;
 	newfd->flags = NBIO_FDT_FLAG_NONE;
 	newfd->pri = pri;
 	newfd->delims = NULL;
+	newfd->delimset = NULL;
+	newfd->framing = NBIO_FRAME_NONE;
+	newfd->framemax = 0;
+	newfd->readbudget = 0;
+	newfd->rxpoollen = 0;
 	newfd->handler = handler;
 	newfd->priv = priv;
-	newfd->timerinterval = 0;
-	newfd->rxchain = newfd->txchain = newfd->txchain_tail = NULL;
+	newfd->timers = newfd->timer = NULL;
+	newfd->revents = 0;
+	newfd->edgeready = newfd->edgewant = 0;
+	newfd->readynext = NULL;
+	newfd->closednext = NULL;
+	newfd->rxstage = NULL;
+	newfd->rxstageoff = newfd->rxstagelen = 0;
+	newfd->rxchain = newfd->rxchain_tail = NULL;
+	newfd->txchain = newfd->txchain_tail = NULL;
 	newfd->rxchain_freelist = newfd->txchain_freelist = NULL;
-	if (preallocchains(newfd, rxlen, txlen) < 0) {
-		free(newfd);
-		return NULL;
-	}
-
-	if (pfdadd(nb, newfd) == -1) {
-		/* XXX free up chains */
-		free(newfd);
+	newfd->rxqueued = newfd->txqueued = 0;
+	newfd->rxfree = newfd->txfree = 0;
+	newfd->txbytes = 0;
+	newfd->txhigh = newfd->txlow = 0;
+	newfd->txfullsent = 0;
+	newfd->txwake = 0;
+	newfd->txtimer = NULL;
+	if ((preallocchains(nb, newfd, rxlen, txlen) < 0) ||
+			(pfdadd(nb, newfd) == -1)) {
+		freechain(nb, newfd->rxchain_freelist);
+		freechain(nb, newfd->txchain_freelist);
+		__nbio_slabfree(nb, newfd, sizeof(nbio_fd_t));
 		errno = ENOMEM;
 		return NULL;
 	}
@@ -426,10 +1517,14 @@ nbio_fd_t *nbio_addfd(nbio_t *nb, int type, nbio_sockfd_t fd, int pri, nbio_hand
 
 	pfdaddfinish(nb, newfd);
 
-	newfd->next = (nbio_fd_t *)nb->fdlist;
+	newfd->prev = NULL;
+	if ((newfd->next = (nbio_fd_t *)nb->fdlist))
+		newfd->next->prev = newfd;
 	nb->fdlist = (void *)newfd;
 
-	setmaxpri(nb);
+	fdtabset(nb, newfd);
+
+	priref(nb, newfd->pri);
 
 	return newfd;
 }
@@ -451,39 +1546,52 @@ int nbio_closefdt(nbio_t *nb, nbio_fd_t *fdt)
 #endif
 
 	fdt_setpollnone(nb, fdt);
+	__nbio_timerdelfdt(nb, fdt);
+	fdt->timer = fdt->txtimer = NULL;
+
+	/* before close(), so the backend can still deregister the fd */
+	pfdrem(nb, fdt);
 
 	fdt_close(fdt);
-	fdt->fd = -1;
+	__fdt_detachfd(nb, fdt);
 	fdt->flags |= NBIO_FDT_FLAG_CLOSED;
 
-	pfdrem(nb, fdt);
+	/* It stays on fdlist until it's freed, so walks of it aren't upset */
+	fdt->closednext = nb->closed;
+	nb->closed = fdt;
 
-	setmaxpri(nb);
+	priunref(nb, fdt->pri);
 
 	return 0;
 }
 
 void __fdt_free(nbio_fd_t *fdt)
 {
-	nbio_buf_t *buf, *tmp;
+	nbio_t *nb = (nbio_t *)fdt->nb;
+	nbio_buf_t *cur;
 
 	nbio_cleardelim(fdt);
 
-	for (buf = fdt->rxchain_freelist; buf; ) {
-		tmp = buf;
-		buf = buf->next;
-		free(tmp);
-	}
+	if (fdt->rxstage != nb->rxscratch)
+		__nbio_slabfree(nb, fdt->rxstage, NBIO_RXSTAGE_LEN);
 
-	for (buf = fdt->txchain_freelist; buf; ) {
-		tmp = buf;
-		buf = buf->next;
-		free(tmp);
+	/*
+	 * The buffers themselves are the application's, except for pool
+	 * buffers and frames it was never handed (or never took).
+	 */
+	for (cur = fdt->rxchain; cur; cur = cur->next) {
+		if (cur->pooled)
+			nbio_bufrelease(nb, cur->data);
 	}
 
+	freechain(nb, fdt->rxchain);
+	freechain(nb, fdt->txchain);
+	freechain(nb, fdt->rxchain_freelist);
+	freechain(nb, fdt->txchain_freelist);
+
 	pfdfree(fdt);
 
-	free(fdt);
+	__nbio_slabfree(nb, fdt, sizeof(nbio_fd_t));
 
 	return;
 }
@@ -530,24 +1638,31 @@ void nbio_flushall(nbio_t *nb)
 }
 
 /* Do all cleanups that are normally done in nbio_poll */
+/*
+ * For callers that aren't polling: close-on-flush streams with nothing
+ * left to write get their EOF here (once, as in nbio_poll), and anything
+ * closed is freed.
+ */
 int nbio_cleanuponly(nbio_t *nb)
 {
-	nbio_fd_t *cur = NULL, **prev = NULL;
+	nbio_fd_t *cur;
+
+	if (!nb) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	for (prev = (nbio_fd_t **)&nb->fdlist; (cur = *prev); ) {
+	for (cur = (nbio_fd_t *)nb->fdlist; cur; cur = cur->next) {
 
-		if (cur->flags & NBIO_FDT_FLAG_CLOSED) {
-			*prev = cur->next;
-			__fdt_free(cur);
+		if (cur->flags & NBIO_FDT_FLAG_CLOSED)
 			continue;
-		}
 
 		if ((cur->flags & NBIO_FDT_FLAG_CLOSEONFLUSH) && !cur->txchain)
-			cur->handler(nb, NBIO_EVENT_EOF, cur);
-
-		prev = &cur->next;
+			__fdt_ready_eof(nb, cur);
 	}
 
+	freeclosed(nb);
+
 	return 0;
 }
 
@@ -604,34 +1719,278 @@ int __fdt_ready_out(nbio_t *nb, nbio_fd_t *fdt)
 int __fdt_ready_eof(nbio_t *nb, nbio_fd_t *fdt)
 {
 
+	if (fdt->flags & NBIO_FDT_FLAG_EOFSENT)
+		return 0;
+
+	if (fdt->flags & NBIO_FDT_FLAG_CLOSEONFLUSH)
+		fdt->flags |= NBIO_FDT_FLAG_EOFSENT;
+
 	if ((fdt->fd != -1) && fdt->handler)
 		fdt->handler(nb, NBIO_EVENT_EOF, fdt);
 
 	return 0;
 }
 
-int __fdt_ready_all(nbio_t *nb, nbio_fd_t *fdt)
+/*
+ * Called whenever the txchain may have just emptied.  The EOF goes through
+ * the ready queue, so it's never called from inside the caller's own
+ * nbio_remtoptxvector().
+ */
+void __fdt_flushcheck(nbio_t *nb, nbio_fd_t *fdt)
+{
+
+	if ((fdt->flags & NBIO_FDT_FLAG_CLOSEONFLUSH) && !fdt->txchain &&
+			!(fdt->flags & NBIO_FDT_FLAG_EOFSENT))
+		__fdt_queueready(nb, fdt, NBIO_READY_EOF);
+
+	return;
+}
+
+void __fdt_queueready(nbio_t *nb, nbio_fd_t *fdt, int events)
+{
+	struct nbio__prilevel *pl;
+
+	if (!events || (fdt->flags & NBIO_FDT_FLAG_CLOSED))
+		return;
+
+	if (fdt->revents) {
+		fdt->revents |= events; /* already queued */
+		return;
+	}
+
+	pl = nb->pris + fdt->pri;
+
+	fdt->revents = events;
+	fdt->readynext = NULL;
+	if (pl->readytail)
+		pl->readytail->readynext = fdt;
+	else
+		pl->readyhead = fdt;
+	pl->readytail = fdt;
+
+	pl->readycount++;
+	nb->readycount++;
+
+	return;
+}
+
+/*
+ * Edge-triggered backends report here instead.  What the kernel said stays
+ * in edgeready until a read or write gets EAGAIN, and is only dispatched
+ * while the fdt wants it.
+ */
+void __fdt_queueedge(nbio_t *nb, nbio_fd_t *fdt, int events)
+{
+
+	fdt->edgeready |= events & (NBIO_READY_IN | NBIO_READY_OUT);
+
+	__fdt_queueready(nb, fdt, events & (~(NBIO_READY_IN | NBIO_READY_OUT) | fdt->edgewant));
+
+	return;
+}
+
+/* fdt_setpollin/out/none, for edge-triggered fdts */
+void __fdt_edgewant(nbio_t *nb, nbio_fd_t *fdt, int events, int val)
+{
+
+	if (!val) {
+		fdt->edgewant &= ~events;
+		return;
+	}
+
+	fdt->edgewant |= events;
+
+	/* No edge is coming for what's already ready */
+	__fdt_queueready(nb, fdt, fdt->edgeready & events);
+
+	return;
+}
+
+int nbio_setedge(nbio_t *nb, nbio_fd_t *fdt, int val)
+{
+	int want;
+
+	if (!nb || !fdt || (fdt->type != NBIO_FDTYPE_STREAM) ||
+			(fdt->flags & NBIO_FDT_FLAG_CLOSED)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!nb->backend->setedge) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if (!val == !(fdt->flags & NBIO_FDT_FLAG_EDGE))
+		return 0;
+
+	if (val) {
+
+		/* The kernel reports what's ready already when it's switched */
+		if ((want = nb->backend->setedge(nb, fdt, 1)) == -1)
+			return -1;
+
+		fdt->flags |= NBIO_FDT_FLAG_EDGE;
+		fdt->edgewant = want;
+		fdt->edgeready = 0;
+
+	} else {
+
+		want = fdt->edgewant;
+
+		fdt->flags &= ~NBIO_FDT_FLAG_EDGE;
+		fdt->edgewant = fdt->edgeready = 0;
+
+		nb->backend->setedge(nb, fdt, 0);
+		fdt_setpollin(nb, fdt, !!(want & NBIO_READY_IN));
+		fdt_setpollout(nb, fdt, !!(want & NBIO_READY_OUT));
+	}
+
+	return 0;
+}
+
+/*
+ * The watermark events are queued instead of called from here, since this
+ * is usually called from inside nbio_addtxvector().  If it crosses back
+ * before they're dispatched, nothing is called at all.
+ */
+void __fdt_txcheck(nbio_t *nb, nbio_fd_t *fdt)
+{
+
+	if (!fdt->txhigh)
+		return;
+
+	if (!(fdt->flags & NBIO_FDT_FLAG_TXFULL) && (fdt->txbytes >= fdt->txhigh)) {
+		fdt->flags |= NBIO_FDT_FLAG_TXFULL;
+		__fdt_queueready(nb, fdt, NBIO_READY_TXMARK);
+	} else if ((fdt->flags & NBIO_FDT_FLAG_TXFULL) && (fdt->txbytes <= fdt->txlow)) {
+		fdt->flags &= ~NBIO_FDT_FLAG_TXFULL;
+		__fdt_queueready(nb, fdt, NBIO_READY_TXMARK);
+	}
+
+	return;
+}
+
+static int txmarkready(nbio_t *nb, nbio_fd_t *fdt)
+{
+	int full = !!(fdt->flags & NBIO_FDT_FLAG_TXFULL);
+
+	if (full == fdt->txfullsent)
+		return 0;
+
+	fdt->txfullsent = full;
+
+	if (fdt->handler(nb, full ? NBIO_EVENT_TXFULL : NBIO_EVENT_TXDRAINED, fdt) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int readydispatch(nbio_t *nb)
 {
+	int curpri;
+
+	/* Nothing above maxpri is open, and priunref() swept those levels */
+	for (curpri = nb->maxpri; curpri >= 0; curpri--) {
+		struct nbio__prilevel *pl = nb->pris + curpri;
+		int n;
 
-	if (fdt->timerinterval) {
-		time_t now;
+		/*
+		 * Anything the handlers queue while we're here waits for the
+		 * next pass.  If one closes the last fdt at this level, the rest
+		 * of it may be swept out from under us.
+		 */
+		for (n = pl->readycount; (n > 0) && pl->readyhead; n--) {
+			nbio_fd_t *cur;
+			int revents;
+
+			cur = pl->readyhead;
+			if (!(pl->readyhead = cur->readynext))
+				pl->readytail = NULL;
+			pl->readycount--;
+			nb->readycount--;
+
+			revents = cur->revents;
+			cur->revents = 0;
+			cur->readynext = NULL;
+
+			if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
+					(revents & NBIO_READY_IN)) {
+				if (__fdt_ready_in(nb, cur) == -1)
+					return -1;
+			}
 
-		now = time(NULL);
+			if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
+					(revents & NBIO_READY_OUT)) {
+				if (__fdt_ready_out(nb, cur) == -1)
+					return -1;
+			}
 
-		if (fdt->timernextfire <= now) {
+			if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
+					(revents & NBIO_READY_TXMARK)) {
+				if (txmarkready(nb, cur) == -1)
+					return -1;
+			}
 
-			fdt->handler(nb, NBIO_EVENT_TIMEREXPIRE, fdt);
+			if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
+					(revents & NBIO_READY_EOF)) {
+				if (__fdt_ready_eof(nb, cur) == -1)
+					return -1;
+			}
 
-			fdt->timernextfire = time(NULL) + fdt->timerinterval;
+			/* Stopped short of EAGAIN (the read budget, say), so there won't be another edge */
+			if (cur->edgeready & cur->edgewant)
+				__fdt_queueready(nb, cur, cur->edgeready & cur->edgewant);
 		}
 	}
 
-	if ((fdt->flags & NBIO_FDT_FLAG_CLOSEONFLUSH) && !fdt->txchain)
-		fdt->handler(nb, NBIO_EVENT_EOF, fdt);
+	return 0;
+}
+
+static int dispatchpass(nbio_t *nb)
+{
+
+	if (__nbio_timerrun(nb) == -1)
+		return -1;
+
+	if (readydispatch(nb) == -1)
+		return -1;
+
+	freeclosed(nb);
 
 	return 0;
 }
 
+int __nbio_dispatch(nbio_t *nb)
+{
+	int ret;
+
+	__nbio_clockupdate(nb);
+
+	nb->inpass = 1;
+	ret = dispatchpass(nb);
+	nb->inpass = 0;
+
+	return ret;
+}
+
+int __nbio_polltimeout(nbio_t *nb, int timeout)
+{
+	int wait;
+
+	/* Don't sleep if there's work queued already */
+	if (nb->readycount)
+		return 0;
+
+	/* or past the next timer */
+	if ((wait = __nbio_timernext(nb)) != -1) {
+		if ((timeout < 0) || (wait < timeout))
+			timeout = wait;
+	}
+
+	return timeout;
+}
+
 int nbio_poll(nbio_t *nb, int timeout)
 {
 	return pfdpoll(nb, timeout);
@@ -640,14 +1999,24 @@ int nbio_poll(nbio_t *nb, int timeout)
 int nbio_setpri(nbio_t *nb, nbio_fd_t *fdt, int pri)
 {
 
-	if (!nb || !fdt || (pri < 0)) {
+	int oldpri;
+
+	if (!nb || !fdt || (pri < 0) || (pri > NBIO_PRI_MAX)) {
 		errno = EINVAL;
 		return -1;
 	}
 
+	if (prigrow(nb, pri) == -1)
+		return -1;
+
+	oldpri = fdt->pri;
 	fdt->pri = pri;
 
-	setmaxpri(nb);
+	/* closed fdts were already taken out of the counts */
+	if (!(fdt->flags & NBIO_FDT_FLAG_CLOSED)) {
+		priref(nb, pri);
+		priunref(nb, oldpri); /* after the move, so a sweep requeues it there */
+	}
 
 	return 0;
 }
@@ -686,7 +2055,8 @@ int nbio_setraw(nbio_t *nb, nbio_fd_t *fdt, int val)
 		fdt_setpollout(nb, fdt, 1);
 
 	} else {
-		if (fdt->rxchain)
+		if (fdt->rxchain || fdt->framing || fdt->rxpoollen ||
+				(fdt->flags & NBIO_FDT_FLAG_SHAREDRX))
 			fdt_setpollin(nb, fdt, 1);
 		if (fdt->txchain)
 			fdt_setpollout(nb, fdt, 1);
@@ -703,9 +2073,10 @@ int nbio_setcloseonflush(nbio_fd_t *fdt, int val)
 		return -1;
 	}
 
-	if (val)
+	if (val) {
 		fdt->flags |= NBIO_FDT_FLAG_CLOSEONFLUSH;
-	else
+		__fdt_flushcheck((nbio_t *)fdt->nb, fdt);
+	} else
 		fdt->flags &= ~NBIO_FDT_FLAG_CLOSEONFLUSH;
 
 	return 0;
@@ -725,7 +2096,7 @@ int nbio_adddelim(nbio_t *nb, nbio_fd_t *fdt, const unsigned char *delim, const
 		return -1;
 	}
 
-	if (!(nd = malloc(sizeof(nbio_delim_t))))
+	if (!(nd = __nbio_slaballoc(nb, sizeof(nbio_delim_t))))
 		return -1;
 
 	nd->len = delimlen;
@@ -734,6 +2105,12 @@ int nbio_adddelim(nbio_t *nb, nbio_fd_t *fdt, const unsigned char *delim, const
 	nd->next = fdt->delims;
 	fdt->delims = nd;
 
+	if (__fdt_delimcompile(fdt) == -1) {
+		fdt->delims = nd->next;
+		__nbio_slabfree(nb, nd, sizeof(nbio_delim_t));
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -750,12 +2127,14 @@ int nbio_cleardelim(nbio_fd_t *fdt)
 		nbio_delim_t *tmp;
 
 		tmp = cur->next;
-		free(cur);
+		__nbio_slabfree((nbio_t *)fdt->nb, cur, sizeof(nbio_delim_t));
 		cur = tmp;
 	}
 
 	fdt->delims = NULL;
 
+	__fdt_delimfree(fdt);
+
 	return 0;
 }
 
@@ -775,6 +2154,128 @@ int nbio_setkeepdelim(nbio_fd_t *fdt, int val)
 	return 0;
 }
 
+int nbio_setframing(nbio_t *nb, nbio_fd_t *fdt, int framing, int maxlen)
+{
+
+	if (!nb || !fdt || (fdt->type != NBIO_FDTYPE_STREAM)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((framing != NBIO_FRAME_NONE) && (framing != NBIO_FRAME_U16BE) &&
+			(framing != NBIO_FRAME_U32BE) && (framing != NBIO_FRAME_VARINT)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((framing != NBIO_FRAME_NONE) && (maxlen < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fdt->framing = framing;
+	fdt->framemax = maxlen;
+
+	if (fdt->flags & (NBIO_FDT_FLAG_RAW | NBIO_FDT_FLAG_RAWREAD))
+		return 0;
+
+	if (fdt->framing) {
+		/* there's always room for another frame */
+		fdt_setpollin(nb, fdt, 1);
+		if (fdt->rxstagelen)
+			__fdt_queueready(nb, fdt, NBIO_READY_IN);
+	} else if (!fdt->rxchain && !fdt->rxpoollen &&
+			!(fdt->flags & NBIO_FDT_FLAG_SHAREDRX))
+		fdt_setpollin(nb, fdt, 0);
+
+	return 0;
+}
+
+int nbio_setreadbudget(nbio_t *nb, nbio_fd_t *fdt, int bytes)
+{
+
+	if (!nb || (bytes < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fdt)
+		fdt->readbudget = bytes;
+	else
+		nb->readbudget = bytes;
+
+	return 0;
+}
+
+int nbio_setrxpool(nbio_t *nb, nbio_fd_t *fdt, int buflen)
+{
+
+	if (!nb || !fdt || (fdt->type != NBIO_FDTYPE_STREAM) || (buflen < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fdt->rxpoollen = buflen;
+
+	if (fdt->flags & (NBIO_FDT_FLAG_RAW | NBIO_FDT_FLAG_RAWREAD))
+		return 0;
+
+	if (fdt->rxpoollen)
+		fdt_setpollin(nb, fdt, 1);
+	else if (!fdt->rxchain && !fdt->framing &&
+			!(fdt->flags & NBIO_FDT_FLAG_SHAREDRX))
+		fdt_setpollin(nb, fdt, 0);
+
+	return 0;
+}
+
+int nbio_settxwatermarks(nbio_t *nb, nbio_fd_t *fdt, int high, int low)
+{
+
+	if (!nb || !fdt || (fdt->type != NBIO_FDTYPE_STREAM) ||
+			(high < 0) || (low < 0) || (high && (low >= high))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fdt->txhigh = high;
+	fdt->txlow = low;
+
+	if (!fdt->txhigh) {
+		fdt->flags &= ~NBIO_FDT_FLAG_TXFULL;
+		fdt->txfullsent = 0;
+		return 0;
+	}
+
+	__fdt_txcheck(nb, fdt);
+
+	return 0;
+}
+
+int nbio_setsharedrx(nbio_t *nb, nbio_fd_t *fdt, int val)
+{
+
+	if (!nb || !fdt || (fdt->type != NBIO_FDTYPE_STREAM)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (val)
+		fdt->flags |= NBIO_FDT_FLAG_SHAREDRX;
+	else
+		fdt->flags &= ~NBIO_FDT_FLAG_SHAREDRX;
+
+	if (fdt->flags & (NBIO_FDT_FLAG_RAW | NBIO_FDT_FLAG_RAWREAD))
+		return 0;
+
+	if (val)
+		fdt_setpollin(nb, fdt, 1);
+	else if (!fdt->rxchain && !fdt->framing && !fdt->rxpoollen)
+		fdt_setpollin(nb, fdt, 0);
+
+	return 0;
+}
+
 int nbio_sfd_close(nbio_t *nb, nbio_sockfd_t fd)
 {
 	return fdt_closefd(fd);
@@ -831,6 +2332,49 @@ nbio_sockfd_t nbio_getincomingconn(nbio_t *nb, nbio_fd_t *fdt, struct sockaddr *
 	return nbio_sfd_accept(nb, fdt->fd, saret, salen);
 }
 
+int nbio_acceptbatch(nbio_t *nb, nbio_fd_t *listener, nbio_accept_callback_t cb, int max)
+{
+	struct sockaddr_storage sa;
+	nbio_sockfd_t fd;
+	int salen, n;
+
+	if (!nb || !listener || !cb || (max < 0) ||
+			(listener->type != NBIO_FDTYPE_LISTENER) ||
+			(listener->flags & NBIO_FDT_FLAG_CLOSED)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (n = 0; !max || (n < max); ) {
+
+		salen = sizeof(sa);
+		if ((fd = fdt_acceptnb(listener->fd, (struct sockaddr *)&sa, &salen)) == -1) {
+
+			/* Gone before we got to it; try the next one */
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+
+			if (errno == EAGAIN)
+				break;
+
+			/* eg, EMFILE: still report the ones we did get */
+			if (n)
+				break;
+
+			return -1;
+		}
+		n++;
+
+		if (cb(nb, listener, fd, (struct sockaddr *)&sa, salen) == -1)
+			return -1;
+
+		if (listener->flags & NBIO_FDT_FLAG_CLOSED)
+			break;
+	}
+
+	return n;
+}
+
 nbio_sockfd_t nbio_sfd_newlistener(nbio_t *nb, const char *addr, unsigned short port)
 {
 	return fdt_newlistener(addr, port);
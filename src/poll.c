@@ -20,7 +20,7 @@
 #include <config.h>
 #endif
 
-#if !defined(NBIO_USE_KQUEUE) && !defined(NBIO_USE_WINSOCK2) && !defined(NBIO_USE_SELECT)
+#if defined(HAVE_SYS_POLL_H) && !defined(NBIO_USE_WINSOCK2)
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -49,35 +49,45 @@
 #include <libnbio.h>
 #include "impl.h"
 
-#define NBIO_PFD_INVAL -1
+#define NBIO_PFD_MINSIZE 16
+
+/*
+ * pfds[0..pfdcount-1] are all in use, so poll() never sees a hole.  A new
+ * fdt takes the slot after the last, and a removed one's slot gets the
+ * last one moved into it.  Since slots move, the fdt keeps an index rather
+ * than a pointer.
+ */
 
 /* nbio_t->intdata */
 struct pfdnbdata {
 	struct pollfd *pfds;
+	nbio_fd_t **fdts; /* fdts[i] owns pfds[i] */
 	int pfdsize;
-	int pfdlast;
+	int pfdcount;
 };
 
-static int setpfdlast(nbio_t *nb)
+/* nbio_fd_t->intdata */
+struct fdtdata {
+	int idx; /* into pfds, or -1 if removed */
+};
+
+static struct pollfd *getpfd(nbio_t *nb, nbio_fd_t *fdt)
 {
 	struct pfdnbdata *pnd = (struct pfdnbdata *)nb->intdata;
-	int i;
-
-	for (i = pnd->pfdsize-1; (i > -1) &&
-			(pnd->pfds[i].fd == NBIO_PFD_INVAL); i--)
-		;
-
-	if (i < 0)
-		i = 0;
+	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
 
-	pnd->pfdlast = i;
+	if (!data || (data->idx < 0))
+		return NULL;
 
-	return i;
+	return pnd->pfds + data->idx;
 }
 
-void fdt_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
+static void pl_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
 {
-	struct pollfd *pfd = (struct pollfd *)fdt->intdata;
+	struct pollfd *pfd;
+
+	if (!(pfd = getpfd(nb, fdt)))
+		return;
 
 	pfd->events |= POLLHUP;
 
@@ -89,9 +99,12 @@ void fdt_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
 	return;
 }
 
-void fdt_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
+static void pl_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
 {
-	struct pollfd *pfd = (struct pollfd *)fdt->intdata;
+	struct pollfd *pfd;
+
+	if (!(pfd = getpfd(nb, fdt)))
+		return;
 
 	pfd->events |= POLLHUP;
 
@@ -103,9 +116,12 @@ void fdt_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
 	return;
 }
 
-void fdt_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
+static void pl_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
 {
-	struct pollfd *pfd = (struct pollfd *)fdt->intdata;
+	struct pollfd *pfd;
+
+	if (!(pfd = getpfd(nb, fdt)))
+		return;
 
 	pfd->events = POLLHUP;
 	pfd->revents = 0;
@@ -113,89 +129,125 @@ void fdt_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
 	return;
 }
 
-static struct pollfd *findunusedpfd(nbio_t *nb)
+static int growpfds(struct pfdnbdata *pnd)
 {
-	struct pfdnbdata *pnd = (struct pfdnbdata *)nb->intdata;
-	int i;
+	struct pollfd *newpfds;
+	nbio_fd_t **newfdts;
+	int newsize;
 
-	for (i = 0; (i < pnd->pfdsize) &&
-			(pnd->pfds[i].fd != NBIO_PFD_INVAL); i++)
-		;
+	newsize = pnd->pfdsize * 2;
 
-	if (i >= pnd->pfdsize)
-		return NULL;
+	if (!(newpfds = realloc(pnd->pfds, sizeof(struct pollfd) * newsize)))
+		return -1;
+	pnd->pfds = newpfds;
 
-	return pnd->pfds + i;
+	if (!(newfdts = realloc(pnd->fdts, sizeof(nbio_fd_t *) * newsize)))
+		return -1;
+	pnd->fdts = newfdts;
+
+	pnd->pfdsize = newsize;
+
+	return 0;
 }
 
-int pfdadd(nbio_t *nb, nbio_fd_t *newfd)
+static int pl_pfdadd(nbio_t *nb, nbio_fd_t *newfd)
 {
+	struct pfdnbdata *pnd = (struct pfdnbdata *)nb->intdata;
+	struct fdtdata *data;
 	struct pollfd *pfd;
 
-	if (!(pfd = newfd->intdata = (void *)findunusedpfd(nb)))
+	if ((pnd->pfdcount == pnd->pfdsize) && (growpfds(pnd) == -1))
+		return -1;
+
+	if (!(data = __nbio_slaballoc(nb, sizeof(struct fdtdata))))
 		return -1;
 
+	data->idx = pnd->pfdcount++;
+	newfd->intdata = (void *)data;
+
+	pfd = pnd->pfds + data->idx;
 	pfd->fd = newfd->fd;
+	pfd->events = pfd->revents = 0;
+	pnd->fdts[data->idx] = newfd;
 
 	return 0;
 }
 
-void pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
+static void pl_pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
 {
-
-	setpfdlast(nb);
-
+	/* unused. */
 	return;
 }
 
-void pfdrem(nbio_t *nb, nbio_fd_t *fdt)
+static void pl_pfdrem(nbio_t *nb, nbio_fd_t *fdt)
 {
-	struct pollfd *pfd = (struct pollfd *)fdt->intdata;
+	struct pfdnbdata *pnd = (struct pfdnbdata *)nb->intdata;
+	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
+	int last;
 
-	if (!pfd)
+	if (!data || (data->idx < 0))
 		return;
 
-	pfd->fd = NBIO_PFD_INVAL;
-	pfd->events = pfd->revents = 0;
-	pfd = NULL;
+	last = --pnd->pfdcount;
 
-	setpfdlast(nb);
+	if (data->idx != last) {
+		nbio_fd_t *moved = pnd->fdts[last];
+
+		pnd->pfds[data->idx] = pnd->pfds[last];
+		pnd->fdts[data->idx] = moved;
+		((struct fdtdata *)moved->intdata)->idx = data->idx;
+	}
+
+	pnd->fdts[last] = NULL;
+	data->idx = -1;
 
 	return;
 }
 
-void pfdfree(nbio_fd_t *fdt)
+static void pl_pfdfree(nbio_fd_t *fdt)
 {
-	return; /* not used */
+	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
+
+	__nbio_slabfree((nbio_t *)fdt->nb, data, sizeof(struct fdtdata));
+	fdt->intdata = NULL;
+
+	return;
 }
 
-int pfdinit(nbio_t *nb, int pfdsize)
+static int pl_pfdinit(nbio_t *nb, int pfdsize)
 {
 	struct pfdnbdata *pnd;
-	int i;
 
 	if (!(pnd = nb->intdata = malloc(sizeof(struct pfdnbdata))))
 		return -1;
 
+	/* Just a starting point; it grows as needed */
+	if (pfdsize < NBIO_PFD_MINSIZE)
+		pfdsize = NBIO_PFD_MINSIZE;
+
 	pnd->pfdsize = pfdsize;
-	if (!(pnd->pfds = malloc(sizeof(struct pollfd) * pnd->pfdsize)))
+	pnd->pfdcount = 0;
+	if (!(pnd->pfds = malloc(sizeof(struct pollfd) * pnd->pfdsize))) {
+		free(pnd);
+		nb->intdata = NULL;
+		return -1;
+	}
+	if (!(pnd->fdts = malloc(sizeof(nbio_fd_t *) * pnd->pfdsize))) {
+		free(pnd->pfds);
+		free(pnd);
+		nb->intdata = NULL;
 		return -1;
-
-	for (i = 0; i < pnd->pfdsize; i++) {
-		pnd->pfds[i].fd = NBIO_PFD_INVAL;
-		pnd->pfds[i].events = 0;
 	}
-
-	setpfdlast(nb);
 
 	return 0;
 }
 
-void pfdkill(nbio_t *nb)
+static void pl_pfdkill(nbio_t *nb)
 {
 	struct pfdnbdata *pnd = (struct pfdnbdata *)nb->intdata;
 
 	free(pnd->pfds);
+	free(pnd->fdts);
 	free(pnd);
 
 	nb->intdata = NULL;
@@ -203,10 +255,10 @@ void pfdkill(nbio_t *nb)
 	return;
 }
 
-int pfdpoll(nbio_t *nb, int timeout)
+static int pl_pfdpoll(nbio_t *nb, int timeout)
 {
 	struct pfdnbdata *pnd = (struct pfdnbdata *)nb->intdata;
-	int pollret, curpri;
+	int pollret, left, i;
 
 	if (!nb) {
 		errno = EINVAL;
@@ -214,7 +266,7 @@ int pfdpoll(nbio_t *nb, int timeout)
 	}
 
 	errno = 0;
-	if ((pollret = poll(pnd->pfds, pnd->pfdlast+1, timeout)) == -1) {
+	if ((pollret = poll(pnd->pfds, pnd->pfdcount, __nbio_polltimeout(nb, timeout))) == -1) {
 
 		/* Never return EINTR from nbio_poll... */
 		if (errno == EINTR) {
@@ -226,55 +278,39 @@ int pfdpoll(nbio_t *nb, int timeout)
 
 	}
 
-	for (curpri = nb->maxpri; curpri >= 0; curpri--) {
-		nbio_fd_t *cur = NULL, **prev = NULL;
-
-		for (prev = (nbio_fd_t **)&nb->fdlist; (cur = *prev); ) {
-			struct pollfd *pfd;
-
-			if (cur->flags & NBIO_FDT_FLAG_CLOSED) {
-				*prev = cur->next;
-				__fdt_free(cur);
-				continue;
-			}
-
-			if (cur->pri != curpri) {
-				prev = &cur->next;
-				continue;
-			}
-
-			pfd = (struct pollfd *)cur->intdata;
-			if (pfd) {
-				if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
-						(pfd->revents & POLLIN)) {
-					if (__fdt_ready_in(nb, cur) == -1)
-						return -1;
-				}
-
-				if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
-						(pfd->revents & POLLOUT)) {
-					if (__fdt_ready_out(nb, cur) == -1)
-						return -1;
-				}
-
-				if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
-						((pfd->revents & POLLERR) ||
-						 (pfd->revents & POLLHUP) ||
-						 (pfd->revents & POLLNVAL))) {
-					if (__fdt_ready_eof(nb, cur) == -1)
-						return -1;
-				}
-			}
-
-			if (__fdt_ready_all(nb, cur) == -1)
-				return -1;
-
-			prev = &cur->next;
-		}
+	for (i = 0, left = pollret; left && (i < pnd->pfdcount); i++) {
+		short revents = pnd->pfds[i].revents;
+		int events = 0;
+
+		if (!revents)
+			continue;
+		left--;
+
+		if (revents & POLLIN)
+			events |= NBIO_READY_IN;
+		if (revents & POLLOUT)
+			events |= NBIO_READY_OUT;
+		if (revents & (POLLERR | POLLHUP | POLLNVAL))
+			events |= NBIO_READY_EOF;
+
+		__fdt_queueready(nb, pnd->fdts[i], events);
 	}
 
+	if (__nbio_dispatch(nb) == -1)
+		return -1;
+
 	return pollret;
 }
 
-#endif /* !def KQUEUE && !def WINSOCK2 */
+const struct nbio__backend __nbio_backend_poll = {
+	NBIO_BACKEND_POLL, "poll",
+	pl_pfdinit, pl_pfdkill,
+	pl_pfdadd, pl_pfdaddfinish, pl_pfdrem, pl_pfdfree,
+	pl_pfdpoll,
+	pl_setpollin, pl_setpollout, pl_setpollnone,
+	NULL, /* no edge-triggered mode */
+	NULL, NULL
+};
+
+#endif /* def HAVE_SYS_POLL_H && !def NBIO_USE_WINSOCK2 */
 
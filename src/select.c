@@ -30,7 +30,7 @@
 #include <config.h>
 #endif
 
-#if !defined(NBIO_USE_KQUEUE) && !defined(NBIO_USE_WINSOCK2) && defined(NBIO_USE_SELECT)
+#if !defined(NBIO_USE_WINSOCK2)
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -65,7 +65,7 @@
 
 #define NBIO_PFD_INVAL -1
 
-int pfdinit(nbio_t *nb, int pfdsize)
+static int sel_pfdinit(nbio_t *nb, int pfdsize)
 {
 
 	/* unused. */
@@ -75,7 +75,7 @@ int pfdinit(nbio_t *nb, int pfdsize)
 }
 
 /* This kills the nbio_t, not a pfd -- confusing name. */
-void pfdkill(nbio_t *nb)
+static void sel_pfdkill(nbio_t *nb)
 {
 
 	/* unused. */
@@ -116,11 +116,11 @@ static int setmaxfd(nbio_t *nb)
 }
 #endif
 
-int pfdadd(nbio_t *nb, nbio_fd_t *newfd)
+static int sel_pfdadd(nbio_t *nb, nbio_fd_t *newfd)
 {
 	struct fdtdata *data;
 
-	if (!(data = malloc(sizeof(struct fdtdata))))
+	if (!(data = __nbio_slaballoc(nb, sizeof(struct fdtdata))))
 		return -1;
 	memset(data, 0, sizeof(struct fdtdata));
 	newfd->intdata = (void *)data;
@@ -130,32 +130,32 @@ int pfdadd(nbio_t *nb, nbio_fd_t *newfd)
 	return 0;
 }
 
-void pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
+static void sel_pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
 {
 	/* unused. */
 	return;
 }
 
-void pfdrem(nbio_t *nb, nbio_fd_t *fdt)
+static void sel_pfdrem(nbio_t *nb, nbio_fd_t *fdt)
 {
 	/* unused. */
 	return;
 }
 
-void pfdfree(nbio_fd_t *fdt)
+static void sel_pfdfree(nbio_fd_t *fdt)
 {
 	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
 
-	free(data);
+	__nbio_slabfree((nbio_t *)fdt->nb, data, sizeof(struct fdtdata));
 	fdt->intdata = NULL;
 
 	return;
 }
 
-int pfdpoll(nbio_t *nb, int timeout)
+static int sel_pfdpoll(nbio_t *nb, int timeout)
 {
-	int selret;
-	nbio_fd_t *cur = NULL, **prev = NULL;
+	int selret, i;
+	nbio_fd_t *cur = NULL;
 	fd_set rfds, wfds;
 	struct timeval tv;
 	int maxfd;
@@ -168,6 +168,8 @@ int pfdpoll(nbio_t *nb, int timeout)
 	FD_ZERO(&rfds);
 	FD_ZERO(&wfds);
 
+	timeout = __nbio_polltimeout(nb, timeout);
+
 	if (timeout != -1) {
 		memset(&tv, 0, sizeof(tv));
 		tv.tv_sec = timeout / 1000;
@@ -194,7 +196,11 @@ int pfdpoll(nbio_t *nb, int timeout)
 			maxfd = cur->fd;
 	}
 
-	if (maxfd == -1) {
+	/*
+	 * With nothing to wait on, select() still makes a fine sleep, as
+	 * long as there is a timeout to sleep for.
+	 */
+	if ((maxfd == -1) && (timeout == -1)) {
 		errno = EINVAL;
 		return -1;
 	}
@@ -212,41 +218,28 @@ int pfdpoll(nbio_t *nb, int timeout)
 		return -1;
 	}
 
-	for (prev = (nbio_fd_t **)&nb->fdlist; (cur = *prev); ) {
-
-		if (cur->flags & NBIO_FDT_FLAG_CLOSED) {
-			*prev = cur->next;
-			__fdt_free(cur);
-			continue;
-		}
-
-		/*
-		 * The FD_*() macros will explode if given a -1 fd.
-		 * Remember that the __fdt_ready_*() functions can close
-		 * connections.
-		 */
-		if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
-					FD_ISSET(cur->fd, &rfds)) {
-			if (__fdt_ready_in(nb, cur) == -1)
-				return -1;
-		}
+	for (i = 0; (i <= maxfd) && (selret > 0); i++) {
+		int events = 0;
 
-		if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
-					FD_ISSET(cur->fd, &wfds)) {
-			if (__fdt_ready_out(nb, cur) == -1)
-				return -1;
-		}
+		if (FD_ISSET(i, &rfds))
+			events |= NBIO_READY_IN;
+		if (FD_ISSET(i, &wfds))
+			events |= NBIO_READY_OUT;
 
-		if (__fdt_ready_all(nb, cur) == -1)
-			return -1;
+		if (!events)
+			continue;
 
-		prev = &cur->next;
+		if ((cur = nbio_getfdt(nb, i)))
+			__fdt_queueready(nb, cur, events);
 	}
 
-	return 1;
+	if (__nbio_dispatch(nb) == -1)
+		return -1;
+
+	return selret;
 }
 
-void fdt_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
+static void sel_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
 {
 	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
 
@@ -258,7 +251,7 @@ void fdt_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
 	return;
 }
 
-void fdt_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
+static void sel_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
 {
 	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
 
@@ -270,7 +263,7 @@ void fdt_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
 	return;
 }
 
-void fdt_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
+static void sel_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
 {
 	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
 
@@ -279,5 +272,15 @@ void fdt_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
 	return;
 }
 
-#endif /* !def KQUEUE && !def WINSOCK2 */
+const struct nbio__backend __nbio_backend_select = {
+	NBIO_BACKEND_SELECT, "select",
+	sel_pfdinit, sel_pfdkill,
+	sel_pfdadd, sel_pfdaddfinish, sel_pfdrem, sel_pfdfree,
+	sel_pfdpoll,
+	sel_setpollin, sel_setpollout, sel_setpollnone,
+	NULL, /* no edge-triggered mode */
+	NULL, NULL
+};
+
+#endif /* !def NBIO_USE_WINSOCK2 */
 
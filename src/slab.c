@@ -0,0 +1,248 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Small-object allocator for the per-connection structures (fdts, buffer
+ * nodes, delimiters, backend data, staging buffers).
+ *
+ * Objects are carved out of large chunks, in power-of-two size classes,
+ * and freed objects go on a per-class free list.  Nothing is given back
+ * until nbio_kill(), so once a server has seen its peak number of
+ * connections, setting one up or tearing it down never calls malloc().
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <libnbio.h>
+#include "impl.h"
+
+#define NBIO_SLAB_MINSHIFT 4 /* 16 bytes */
+#define NBIO_SLAB_MAXSHIFT 12 /* 4096 bytes */
+#define NBIO_SLAB_CLASSES (NBIO_SLAB_MAXSHIFT - NBIO_SLAB_MINSHIFT + 1)
+
+#define NBIO_SLAB_CHUNKLEN (64 * 1024)
+#define NBIO_SLAB_HUGECHUNKLEN (2 * 1024 * 1024)
+
+struct slabobj {
+	struct slabobj *next;
+};
+
+/* at the start of every chunk; padded so objects stay aligned */
+union slabchunk {
+	struct {
+		union slabchunk *next;
+		size_t len;
+		int mapped;
+	} h;
+	double align[4];
+};
+
+struct nbio__slab {
+	struct slabobj *freelists[NBIO_SLAB_CLASSES];
+	union slabchunk *chunks;
+	unsigned char *cur; /* unused end of the newest chunk */
+	size_t curleft;
+	int hugepages;
+};
+
+static int sizeclass(size_t size)
+{
+	int i;
+
+	for (i = 0; (size_t)1 << (i + NBIO_SLAB_MINSHIFT) < size; i++)
+		;
+
+	return i;
+}
+
+static union slabchunk *newchunk(struct nbio__slab *slab)
+{
+	union slabchunk *chunk = NULL;
+	size_t len = NBIO_SLAB_CHUNKLEN;
+	int mapped = 0;
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	if (slab->hugepages) {
+		void *p = MAP_FAILED;
+
+		len = NBIO_SLAB_HUGECHUNKLEN;
+
+#ifdef MAP_HUGETLB
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		/* No reserved hugepages; ask for transparent ones instead */
+		if (p == MAP_FAILED) {
+			p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+			if (p != MAP_FAILED)
+				madvise(p, len, MADV_HUGEPAGE);
+#endif
+		}
+
+		if (p != MAP_FAILED) {
+			chunk = (union slabchunk *)p;
+			mapped = 1;
+		} else
+			len = NBIO_SLAB_CHUNKLEN;
+	}
+#endif
+
+	if (!chunk && !(chunk = malloc(len)))
+		return NULL;
+
+	chunk->h.len = len;
+	chunk->h.mapped = mapped;
+	chunk->h.next = slab->chunks;
+	slab->chunks = chunk;
+
+	slab->cur = (unsigned char *)(chunk + 1);
+	slab->curleft = len - sizeof(union slabchunk);
+
+	return chunk;
+}
+
+void *__nbio_slaballoc(nbio_t *nb, size_t size)
+{
+	struct nbio__slab *slab = nb->slab;
+	struct slabobj *obj;
+	int class;
+
+	if (size > ((size_t)1 << NBIO_SLAB_MAXSHIFT))
+		return malloc(size);
+
+	class = sizeclass(size);
+	size = (size_t)1 << (class + NBIO_SLAB_MINSHIFT);
+
+	if ((obj = slab->freelists[class])) {
+		slab->freelists[class] = obj->next;
+		return obj;
+	}
+
+	/* whatever's left of the old chunk is lost; it's less than one object */
+	if ((slab->curleft < size) && !newchunk(slab)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	obj = (struct slabobj *)slab->cur;
+	slab->cur += size;
+	slab->curleft -= size;
+
+	return obj;
+}
+
+void __nbio_slabfree(nbio_t *nb, void *p, size_t size)
+{
+	struct nbio__slab *slab = nb->slab;
+	struct slabobj *obj = (struct slabobj *)p;
+	int class;
+
+	if (!p)
+		return;
+
+	if (size > ((size_t)1 << NBIO_SLAB_MAXSHIFT)) {
+		free(p);
+		return;
+	}
+
+	class = sizeclass(size);
+
+	obj->next = slab->freelists[class];
+	slab->freelists[class] = obj;
+
+	return;
+}
+
+int __nbio_slabinit(nbio_t *nb)
+{
+
+	if (!(nb->slab = malloc(sizeof(struct nbio__slab)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(nb->slab, 0, sizeof(struct nbio__slab));
+
+	return 0;
+}
+
+void __nbio_slabkill(nbio_t *nb)
+{
+	union slabchunk *chunk;
+
+	if (!nb->slab)
+		return;
+
+	while ((chunk = nb->slab->chunks)) {
+		nb->slab->chunks = chunk->h.next;
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+		if (chunk->h.mapped) {
+			munmap((void *)chunk, chunk->h.len);
+			continue;
+		}
+#endif
+		free(chunk);
+	}
+
+	free(nb->slab);
+	nb->slab = NULL;
+
+	return;
+}
+
+int nbio_sethugepages(nbio_t *nb, int val)
+{
+
+	if (!nb || !nb->slab) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nb->slab->hugepages = !!val;
+
+	return 0;
+}
@@ -0,0 +1,530 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Timers, on a hierarchical timing wheel.
+ *
+ * There are NBIO_TIMER_LEVELS wheels of NBIO_TIMER_SLOTS slots each.  A
+ * slot on the first is one millisecond wide, a slot on the second is one
+ * whole turn of the first, and so on.  A timer goes in the slot on the
+ * lowest wheel that reaches as far as it's due; as the clock crosses
+ * into a slot on a higher wheel, that slot's timers get spread back out
+ * over the lower ones (cascading).  Adding, removing, and running a
+ * timer are all constant time, and nothing is looked at on a pass where
+ * nothing is due.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#ifdef NBIO_USE_WINSOCK2
+#include <winsock2.h>
+#endif
+
+#include <libnbio.h>
+#include "impl.h"
+
+#define NBIO_TIMER_SLOTBITS 6
+#define NBIO_TIMER_SLOTS (1 << NBIO_TIMER_SLOTBITS)
+#define NBIO_TIMER_SLOTMASK (NBIO_TIMER_SLOTS - 1)
+#define NBIO_TIMER_LEVELS 4 /* 2^24ms, about four and a half hours */
+
+/* the furthest out the wheels reach; anything later is cascaded again */
+#define NBIO_TIMER_MAXDELTA ((1ULL << (NBIO_TIMER_SLOTBITS * NBIO_TIMER_LEVELS)) - 1)
+
+struct nbio_timer_s {
+	unsigned long long expires; /* ms, on the monotonic clock */
+	int interval; /* ms; 0 for one-shot */
+	nbio_timer_callback_t callback;
+	void *udata;
+	nbio_fd_t *fdt;
+	struct nbio_timer_s **slot; /* list it's on (NULL if none) */
+	struct nbio_timer_s *next, *prev;
+	struct nbio_timer_s *fdtnext, *fdtprev; /* fdt->timers */
+	int level;
+	int running, deleted;
+};
+
+struct nbio__timerwheel {
+	unsigned long long now; /* the next tick to be run */
+	nbio_timer_t *slots[NBIO_TIMER_LEVELS][NBIO_TIMER_SLOTS];
+	int count[NBIO_TIMER_LEVELS];
+};
+
+unsigned long long __nbio_clockms(void)
+{
+#if defined(NBIO_USE_WINSOCK2)
+	return (unsigned long long)GetTickCount();
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ((unsigned long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+
+	return (unsigned long long)time(NULL) * 1000;
+#else
+	return (unsigned long long)time(NULL) * 1000;
+#endif
+}
+
+/*
+ * The wall clock in ms, off the same clock as nb->now, for timing tx
+ * triggers (which are in whole seconds of it).
+ */
+unsigned long long __nbio_realtimems(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_REALTIME_COARSE)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0)
+		return ((unsigned long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#endif
+
+	return (unsigned long long)time(NULL) * 1000;
+}
+
+/*
+ * Sample the clocks once for a whole pass, so that nothing after the
+ * backend wait needs to ask again and every handler sees the same time.
+ */
+void __nbio_clockupdate(nbio_t *nb)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_REALTIME_COARSE)
+	struct timespec ts;
+#endif
+
+	nb->nowms = __nbio_clockms();
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_REALTIME_COARSE)
+	if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+		nb->now = ts.tv_sec;
+		return;
+	}
+#endif
+	nb->now = time(NULL);
+
+	return;
+}
+
+unsigned long long nbio_now(nbio_t *nb)
+{
+
+	if (!nb) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	return nb->nowms;
+}
+
+time_t nbio_time(nbio_t *nb)
+{
+
+	if (!nb) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	return nb->now;
+}
+
+int __nbio_timerinit(nbio_t *nb)
+{
+
+	if (!(nb->timers = malloc(sizeof(struct nbio__timerwheel)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(nb->timers, 0, sizeof(struct nbio__timerwheel));
+
+	nb->timers->now = nb->nowms;
+
+	return 0;
+}
+
+static void slotrem(struct nbio__timerwheel *w, nbio_timer_t *t)
+{
+
+	if (!t->slot)
+		return;
+
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		*t->slot = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+
+	if (t->level >= 0)
+		w->count[t->level]--;
+
+	t->slot = NULL;
+	t->next = t->prev = NULL;
+
+	return;
+}
+
+static void slotadd(nbio_timer_t **slot, nbio_timer_t *t)
+{
+
+	t->slot = slot;
+	t->prev = NULL;
+	if ((t->next = *slot))
+		t->next->prev = t;
+	*slot = t;
+
+	return;
+}
+
+static void insert(struct nbio__timerwheel *w, nbio_timer_t *t)
+{
+	unsigned long long delta, when;
+	int level;
+
+	when = t->expires;
+	if (when < w->now)
+		when = w->now; /* overdue: the next tick */
+
+	delta = when - w->now;
+	if (delta > NBIO_TIMER_MAXDELTA) {
+		delta = NBIO_TIMER_MAXDELTA;
+		when = w->now + delta;
+	}
+
+	for (level = 0; level < NBIO_TIMER_LEVELS - 1; level++) {
+		if (delta < (1ULL << (NBIO_TIMER_SLOTBITS * (level + 1))))
+			break;
+	}
+
+	t->level = level;
+	w->count[level]++;
+	slotadd(&w->slots[level][(when >> (NBIO_TIMER_SLOTBITS * level)) & NBIO_TIMER_SLOTMASK], t);
+
+	return;
+}
+
+static void freetimer(nbio_t *nb, nbio_timer_t *t)
+{
+
+	if (t->fdt) {
+		if (t->fdtprev)
+			t->fdtprev->fdtnext = t->fdtnext;
+		else
+			t->fdt->timers = t->fdtnext;
+		if (t->fdtnext)
+			t->fdtnext->fdtprev = t->fdtprev;
+	}
+
+	__nbio_slabfree(nb, t, sizeof(nbio_timer_t));
+
+	return;
+}
+
+void __nbio_timerkill(nbio_t *nb)
+{
+	int level, i;
+
+	if (!nb->timers)
+		return;
+
+	for (level = 0; level < NBIO_TIMER_LEVELS; level++) {
+		for (i = 0; i < NBIO_TIMER_SLOTS; i++) {
+			nbio_timer_t *t;
+
+			while ((t = nb->timers->slots[level][i])) {
+				slotrem(nb->timers, t);
+				freetimer(nb, t);
+			}
+		}
+	}
+
+	free(nb->timers);
+	nb->timers = NULL;
+
+	return;
+}
+
+nbio_timer_t *nbio_addtimer(nbio_t *nb, nbio_fd_t *fdt, int ms, int interval, nbio_timer_callback_t callback, void *udata)
+{
+	nbio_timer_t *t;
+
+	if (!nb || !nb->timers || (ms < 0) || (interval < 0) ||
+			(!fdt && !callback) ||
+			(fdt && (fdt->flags & NBIO_FDT_FLAG_CLOSED))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(t = __nbio_slaballoc(nb, sizeof(nbio_timer_t)))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(t, 0, sizeof(nbio_timer_t));
+
+	/* From a handler, it's the time of the pass; otherwise it may be stale */
+	if (!nb->inpass)
+		__nbio_clockupdate(nb);
+
+	/* An empty wheel stops turning, so it may need to catch up first */
+	if (!nb->timers->count[0] && !nb->timers->count[1] &&
+			!nb->timers->count[2] && !nb->timers->count[3])
+		nb->timers->now = nb->nowms;
+
+	t->expires = nb->nowms + ms;
+	t->interval = interval;
+	t->callback = callback;
+	t->udata = udata;
+
+	if ((t->fdt = fdt)) {
+		if ((t->fdtnext = fdt->timers))
+			t->fdtnext->fdtprev = t;
+		fdt->timers = t;
+	}
+
+	insert(nb->timers, t);
+
+	return t;
+}
+
+int nbio_deltimer(nbio_t *nb, nbio_timer_t *t)
+{
+
+	if (!nb || !nb->timers || !t || t->deleted) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	slotrem(nb->timers, t);
+
+	/* __nbio_timerrun frees it once the callback returns */
+	if (t->running) {
+		t->deleted = 1;
+		return 0;
+	}
+
+	freetimer(nb, t);
+
+	return 0;
+}
+
+void __nbio_timerdelfdt(nbio_t *nb, nbio_fd_t *fdt)
+{
+
+	while (fdt->timers) {
+		nbio_timer_t *t = fdt->timers;
+
+		nbio_deltimer(nb, t);
+
+		/* still running; the list has to move on regardless */
+		if (fdt->timers == t) {
+			fdt->timers = t->fdtnext;
+			if (t->fdtnext)
+				t->fdtnext->fdtprev = NULL;
+			t->fdt = NULL;
+		}
+	}
+
+	return;
+}
+
+static void cascade(struct nbio__timerwheel *w, int level)
+{
+	nbio_timer_t *t, **slot;
+
+	slot = &w->slots[level][(w->now >> (NBIO_TIMER_SLOTBITS * level)) & NBIO_TIMER_SLOTMASK];
+
+	while ((t = *slot)) {
+		slotrem(w, t);
+		insert(w, t);
+	}
+
+	return;
+}
+
+static int fire(nbio_t *nb, nbio_timer_t *t)
+{
+	int ret;
+
+	if (t->interval) {
+		t->expires += t->interval;
+
+		/* Don't try to catch up on runs that were missed entirely */
+		if (t->expires < nb->timers->now)
+			t->expires = nb->timers->now + t->interval;
+
+		insert(nb->timers, t);
+	}
+
+	t->running = 1;
+
+	if (t->callback)
+		ret = t->callback(nb, t, t->udata);
+	else
+		ret = t->fdt->handler(nb, NBIO_EVENT_TIMEREXPIRE, t->fdt);
+
+	t->running = 0;
+
+	if (t->deleted || !t->interval) {
+		slotrem(nb->timers, t);
+		freetimer(nb, t);
+	}
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/*
+ * Run everything that's due.  Each tick with nothing on the lowest wheel
+ * is skipped all at once, up to the next tick that has a cascade.
+ */
+int __nbio_timerrun(nbio_t *nb)
+{
+	struct nbio__timerwheel *w = nb->timers;
+	unsigned long long until;
+
+	if (!w)
+		return 0;
+
+	until = nb->nowms;
+
+	while (w->now <= until) {
+		nbio_timer_t *due = NULL, *t;
+		unsigned long long gran;
+		int level, idx;
+
+		idx = w->now & NBIO_TIMER_SLOTMASK;
+
+		for (level = 1; (level < NBIO_TIMER_LEVELS) && !idx; level++) {
+			cascade(w, level);
+			idx = (w->now >> (NBIO_TIMER_SLOTBITS * level)) & NBIO_TIMER_SLOTMASK;
+		}
+
+		/* Take the slot as a whole, so callbacks can add and remove anything */
+		idx = w->now & NBIO_TIMER_SLOTMASK;
+		while ((t = w->slots[0][idx])) {
+			slotrem(w, t);
+			slotadd(&due, t);
+			t->level = -1;
+		}
+
+		w->now++;
+
+		while ((t = due)) {
+			slotrem(w, t);
+			if (fire(nb, t) == -1)
+				return -1;
+		}
+
+		for (level = 0, gran = 1; (level < NBIO_TIMER_LEVELS) && !w->count[level]; level++)
+			gran <<= NBIO_TIMER_SLOTBITS;
+
+		if (level == NBIO_TIMER_LEVELS) {
+			w->now = until + 1; /* empty */
+			break;
+		}
+
+		if (gran > 1) {
+			unsigned long long next = (w->now + gran - 1) & ~(gran - 1);
+
+			w->now = (next > until + 1) ? until + 1 : next;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * How long until the next tick that does anything, in ms, or -1 if there
+ * are no timers.  Cascades count, so this is never late, but can be early.
+ */
+int __nbio_timernext(nbio_t *nb)
+{
+	struct nbio__timerwheel *w = nb->timers;
+	unsigned long long next = 0, now;
+	int level, found = 0;
+
+	if (!w)
+		return -1;
+
+	for (level = 0; level < NBIO_TIMER_LEVELS; level++) {
+		int shift = NBIO_TIMER_SLOTBITS * level;
+		unsigned long long gran = 1ULL << shift, when;
+		int cur, k;
+
+		if (!w->count[level])
+			continue;
+
+		cur = (w->now >> shift) & NBIO_TIMER_SLOTMASK;
+
+		/*
+		 * The current slot up here was already cascaded, unless it's
+		 * about to be, so anything in it now is for the next time
+		 * round: a whole turn away, and only if nothing comes sooner.
+		 * If every slot after it is empty, k ends up at a whole turn.
+		 */
+		k = ((level > 0) && (w->now & (gran - 1))) ? 1 : 0;
+		for (; k < NBIO_TIMER_SLOTS; k++) {
+			if (w->slots[level][(cur + k) & NBIO_TIMER_SLOTMASK])
+				break;
+		}
+
+		when = ((w->now >> shift) + k) << shift;
+		if (level == 0)
+			when = w->now + k;
+
+		if (!found || (when < next))
+			next = when;
+		found = 1;
+	}
+
+	if (!found)
+		return -1;
+
+	now = __nbio_clockms();
+	if (next <= now)
+		return 0;
+	if (next - now > 0x7fffffff)
+		return 0x7fffffff;
+
+	return (int)(next - now);
+}
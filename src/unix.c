@@ -23,6 +23,11 @@
 /* XXX ick. */
 #if !defined(NBIO_USE_WINSOCK2)
 
+/* glibc only declares accept4() for _GNU_SOURCE */
+#if defined(HAVE_ACCEPT4) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -32,6 +37,9 @@
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #endif
@@ -80,6 +88,26 @@ int fdt_read(nbio_fd_t *fdt, void *buf, int count)
 	return fdt_readfd(fdt->fd, buf, count);
 }
 
+int fdt_readv(nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt)
+{
+#ifdef HAVE_SYS_UIO_H
+	struct iovec vec[NBIO_IOV_MAX];
+	int i;
+
+	if (iovcnt > NBIO_IOV_MAX)
+		iovcnt = NBIO_IOV_MAX;
+
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].iov_base = iov[i].data;
+		vec[i].iov_len = iov[i].len;
+	}
+
+	return readv(fdt->fd, vec, iovcnt);
+#else
+	return fdt_read(fdt, iov[0].data, iov[0].len);
+#endif
+}
+
 int fdt_writefd(nbio_sockfd_t fd, const void *buf, int count)
 {
 	return write(fd, buf, count);
@@ -90,6 +118,26 @@ int fdt_write(nbio_fd_t *fdt, const void *buf, int count)
 	return fdt_writefd(fdt->fd, buf, count);
 }
 
+int fdt_writev(nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt)
+{
+#ifdef HAVE_SYS_UIO_H
+	struct iovec vec[NBIO_IOV_MAX];
+	int i;
+
+	if (iovcnt > NBIO_IOV_MAX)
+		iovcnt = NBIO_IOV_MAX;
+
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].iov_base = iov[i].data;
+		vec[i].iov_len = iov[i].len;
+	}
+
+	return writev(fdt->fd, vec, iovcnt);
+#else
+	return fdt_write(fdt, iov[0].data, iov[0].len);
+#endif
+}
+
 int fdt_closefd(nbio_sockfd_t fd)
 {
 	return close(fd);
@@ -242,7 +290,7 @@ static int fdt_connect_handler(void *nbv, int event, nbio_fd_t *fdt)
 		return -1;
 	}
 
-	fdt->fd = -1; /* prevent it from being close()'d by closefdt */
+	__fdt_detachfd(nb, fdt); /* prevent it from being close()'d by closefdt */
 
 	free(ci);
 	fdt->flags &= ~NBIO_FDT_FLAG_IGNORE;
@@ -310,5 +358,33 @@ nbio_sockfd_t fdt_acceptfd(nbio_sockfd_t fd, struct sockaddr *saret, int *salen)
 	return accept(fd, saret, (socklen_t *)salen);
 }
 
+nbio_sockfd_t fdt_acceptnb(nbio_sockfd_t fd, struct sockaddr *saret, int *salen)
+{
+	nbio_sockfd_t newfd;
+
+#ifdef HAVE_ACCEPT4
+	/* Built against a libc that has it, but maybe not the kernel */
+	if (((newfd = accept4(fd, saret, (socklen_t *)salen, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) ||
+			(errno != ENOSYS))
+		return newfd;
+#endif
+
+	if ((newfd = accept(fd, saret, (socklen_t *)salen)) == -1)
+		return -1;
+
+	if ((fdt_setnonblock(newfd) == -1) ||
+			(fcntl(newfd, F_SETFD, FD_CLOEXEC) == -1)) {
+		int sav;
+
+		sav = errno;
+		close(newfd);
+		errno = sav;
+
+		return -1;
+	}
+
+	return newfd;
+}
+
 #endif
 
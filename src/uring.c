@@ -0,0 +1,1113 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Linux io_uring support, talking to the kernel directly (no liburing).
+ *
+ * Interest changes made by fdt_setpollin/out only mark the fdt dirty; the
+ * actual (re)arming is batched into the submission queue and handed to
+ * the kernel by the same io_uring_enter() that waits for completions.
+ * Writes are handed over by one more, after the handlers, in passes that
+ * have any.
+ *
+ * Streams the library reads and writes itself do that through the ring
+ * as well, with no read() or write() of their own:
+ *
+ * - Reads are IORING_OP_READs that let the kernel pick the buffer, from a
+ *   group of URING_RXBUFLEN buffers the library provides (one block from
+ *   the buffer pool), so an idle stream isn't holding one.  The buffer
+ *   that came back is handed to streamread through ur_readv, and given
+ *   back to the kernel once it's empty.  If they're all in use, the stream
+ *   is polled and read() instead until one comes back.
+ *
+ * - Writes are copied into a pool buffer and sent with an IORING_OP_SEND
+ *   (up to NBIO_TXIOV_BYTES at a time; a WRITE if it isn't a socket), so the tx buffers are finished,
+ *   and the application gets them back, as soon as streamwrite has
+ *   copied them.  The next write waits for the completion, which is what
+ *   stands in for POLLOUT.  A write still in flight when the fdt is
+ *   closed is left to finish, like data in the socket buffer.
+ *
+ * Anything else (listeners, datagrams, raw streams, which read and write
+ * the socket themselves) is polled with one-shot IORING_OP_POLL_ADDs.  A
+ * stream that goes raw has its read cancelled, but what's already come
+ * back stays for the next buffered read, so set raw mode before adding
+ * read interest.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && !defined(NBIO_USE_WINSOCK2)
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <libnbio.h>
+#include "impl.h"
+
+#define URING_MAXENTRIES 4096
+
+/* the provided read buffers: how many (at most; no more than pfdsize) and how big */
+#define URING_RXBUFS 64
+#define URING_RXBUFLEN 16384
+#define URING_BGID 1
+
+/* CQEs with this user_data (removals, timeouts) carry nothing for us */
+#define URING_UDATA_IGNORE 0
+
+/* giving read buffers to the kernel; failing means it can't do reads that way */
+#define URING_UDATA_PROVIDE 1
+
+/* Otherwise it's the urfdtdata, with which of its operations in the low bits */
+#define URING_OP_POLL  0
+#define URING_OP_READ  1
+#define URING_OP_WRITE 2
+#define URING_OP_MASK  3
+#define UDATA(data, op) ((unsigned long)(data) | (op))
+
+/* Streams the library reads and writes itself (see above) */
+#define RINGTX(fdt) (((fdt)->type == NBIO_FDTYPE_STREAM) && !((fdt)->flags & NBIO_FDT_FLAG_RAW))
+#define RINGRX(und, fdt) ((und)->rxring && RINGTX(fdt) && !((fdt)->flags & NBIO_FDT_FLAG_RAWREAD))
+
+/* nbio_fd_t->intdata */
+struct urfdtdata {
+	nbio_fd_t *fdt; /* NULL once the fdt has been freed */
+	struct urnbdata *und;
+	unsigned int events; /* what we want */
+	unsigned int armedevents; /* what the outstanding poll is for */
+	unsigned char armed; /* a POLL_ADD is in flight */
+	unsigned char cancelling; /* ...and a POLL_REMOVE has been sent for it */
+	unsigned char removed; /* pfdrem() has been called */
+	unsigned char dirty;
+
+	unsigned char reading; /* an IORING_OP_READ is in flight */
+	unsigned char rcancelling; /* ...and it's being cancelled */
+	unsigned char ringrx; /* reads come from the ring, not read() */
+	unsigned char pollrx; /* no read buffers were left; poll until there are */
+	unsigned char rxeof;
+	int rxerr;
+	int rxbid; /* provided buffer with data for ur_readv, or -1 */
+	int rxoff, rxlen;
+
+	unsigned char writing; /* an IORING_OP_SEND (or WRITE) is in flight */
+	unsigned char notsock; /* so it's a WRITE */
+	unsigned char *txbuf; /* pool buffer it's writing from */
+	int txoff, txlen;
+	int txfd; /* once closed, a dup of the fd to finish it with, or -1 */
+	int txerr;
+
+	struct urfdtdata *nextdirty;
+	struct urfdtdata *nextorphan;
+};
+
+/* nbio_t->intdata */
+struct urnbdata {
+	nbio_t *nb; /* orphans are freed back to its slab */
+	int ringfd;
+	unsigned int features;
+
+	void *sqring;
+	size_t sqringsz;
+	unsigned int *sqhead, *sqtail, *sqmask, *sqentries, *sqarray;
+	unsigned int sqlocaltail;
+	struct io_uring_sqe *sqes;
+	size_t sqessz;
+
+	void *cqring;
+	size_t cqringsz;
+	unsigned int *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+
+	struct urfdtdata *dirty;
+	struct urfdtdata *orphans;
+
+	unsigned char *rxbufs; /* nrxbufs of URING_RXBUFLEN, buffer id order */
+	int nrxbufs;
+	int rxring; /* 0 if the kernel can't read into them */
+	int *freebids; /* emptied, to be provided again */
+	int nfreebids;
+
+	struct __kernel_timespec ts;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int tosubmit, unsigned int mincomplete, unsigned int flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags, arg, argsz);
+}
+
+static unsigned int tosubmit(struct urnbdata *und)
+{
+	return und->sqlocaltail - __atomic_load_n(und->sqhead, __ATOMIC_ACQUIRE);
+}
+
+/* Push what's queued to the kernel without waiting */
+static int submit(struct urnbdata *und)
+{
+
+	__atomic_store_n(und->sqtail, und->sqlocaltail, __ATOMIC_RELEASE);
+
+	return sys_io_uring_enter(und->ringfd, tosubmit(und), 0, 0, NULL, 0);
+}
+
+static struct io_uring_sqe *getsqe(struct urnbdata *und)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if ((tosubmit(und) >= *und->sqentries) && (submit(und) == -1))
+		return NULL;
+
+	idx = und->sqlocaltail & *und->sqmask;
+	sqe = und->sqes + idx;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	und->sqarray[idx] = idx;
+	und->sqlocaltail++;
+
+	return sqe;
+}
+
+static void markdirty(struct urfdtdata *data)
+{
+
+	if (data->dirty)
+		return;
+
+	data->dirty = 1;
+	data->nextdirty = data->und->dirty;
+	data->und->dirty = data;
+
+	return;
+}
+
+/* Like poll.c, always ask for hangups. */
+#define WANTEVENTS(data) ((data)->events | POLLHUP)
+
+/* Something for ur_readv to hand over */
+#define RXSTAGED(data) (((data)->rxbid != -1) || (data)->rxeof || (data)->rxerr)
+
+static void update(struct urfdtdata *data, unsigned int old)
+{
+
+	/* (with a read already back, arm() says it's ready again) */
+	if (!data->armed || (data->events != old) || RXSTAGED(data))
+		markdirty(data);
+
+	return;
+}
+
+/* An emptied read buffer, to go back to the kernel next pass */
+static void freebid(struct urnbdata *und, int bid)
+{
+
+	und->freebids[und->nfreebids++] = bid;
+
+	return;
+}
+
+static int queueprovide(struct urnbdata *und, int bid, int nbufs)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = getsqe(und)))
+		return -1;
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = nbufs;
+	sqe->addr = (unsigned long)(und->rxbufs + bid * URING_RXBUFLEN);
+	sqe->len = URING_RXBUFLEN;
+	sqe->off = bid;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = URING_UDATA_PROVIDE;
+
+	return 0;
+}
+
+static int queueread(struct urnbdata *und, struct urfdtdata *data)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = getsqe(und)))
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->fd = data->fdt->fd;
+	sqe->len = URING_RXBUFLEN;
+	sqe->off = (unsigned long long)-1;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = UDATA(data, URING_OP_READ);
+
+	data->reading = 1;
+	data->ringrx = 1;
+
+	return 0;
+}
+
+static int queuewrite(struct urnbdata *und, struct urfdtdata *data)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = getsqe(und)))
+		return -1;
+	sqe->fd = (data->txfd != -1) ? data->txfd : data->fdt->fd;
+	sqe->addr = (unsigned long)(data->txbuf + data->txoff);
+	sqe->len = data->txlen - data->txoff;
+	sqe->user_data = UDATA(data, URING_OP_WRITE);
+
+	/*
+	 * It may finish after the fdt's been closed, where a SIGPIPE would
+	 * come out of nowhere, so sockets don't get one.
+	 */
+	if (data->notsock) {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->off = (unsigned long long)-1;
+	} else {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+
+	data->writing = 1;
+
+	return 0;
+}
+
+static int queuecancel(struct urnbdata *und, struct urfdtdata *data, int op)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = getsqe(und)))
+		return -1;
+	sqe->opcode = (op == URING_OP_POLL) ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = UDATA(data, op);
+	sqe->user_data = URING_UDATA_IGNORE;
+
+	if (op == URING_OP_POLL)
+		data->cancelling = 1;
+	else
+		data->rcancelling = 1;
+
+	return 0;
+}
+
+/*
+ * Queue whatever data needs.  Returns -1 if the ring wouldn't take another
+ * entry, in which case the caller has to put data back on the dirty list.
+ */
+static int arm(struct urnbdata *und, struct urfdtdata *data)
+{
+	nbio_fd_t *fdt = data->fdt;
+	unsigned int want;
+	int gone = !fdt || data->removed;
+
+	/* Closed, or gone raw: the handler reads it now */
+	if (data->reading && !data->rcancelling && (gone || !RINGRX(und, fdt))) {
+		if (queuecancel(und, data, URING_OP_READ) == -1)
+			return -1;
+	}
+
+	if (gone) {
+
+		if (data->armed && !data->cancelling) {
+			if (queuecancel(und, data, URING_OP_POLL) == -1)
+				return -1;
+		}
+
+		/* the rest of a short write */
+		if (data->txbuf && !data->writing) {
+			if (data->txfd == -1) {
+				nbio_bufrelease(und->nb, data->txbuf);
+				data->txbuf = NULL;
+			} else if (queuewrite(und, data) == -1)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	want = WANTEVENTS(data);
+
+	if (RINGTX(fdt)) {
+
+		if (data->txbuf && !data->writing) {
+			if (queuewrite(und, data) == -1)
+				return -1;
+		}
+
+		/* Until there's a write in flight, streamwrite has somewhere to put more */
+		if ((data->events & POLLOUT) && !data->txbuf)
+			__fdt_queueready(und->nb, fdt, NBIO_READY_OUT);
+
+		want &= ~POLLOUT;
+	}
+
+	if ((data->events & POLLIN) && RINGRX(und, fdt) && !data->pollrx) {
+
+		if (RXSTAGED(data))
+			__fdt_queueready(und->nb, fdt, NBIO_READY_IN);
+		else if (!data->reading) {
+			if (queueread(und, data) == -1)
+				return -1;
+		}
+
+		want &= ~POLLIN;
+	}
+
+	/* A read in flight finds out about hangups too */
+	if (data->reading && !(want & ~POLLHUP))
+		want = 0;
+
+	if (data->armed) {
+
+		/* Re-armed with the new mask when the cancellation completes */
+		if ((data->armedevents != want) && !data->cancelling) {
+			if (queuecancel(und, data, URING_OP_POLL) == -1)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	if (!want)
+		return 0;
+
+	{
+		struct io_uring_sqe *sqe;
+
+		if (!(sqe = getsqe(und)))
+			return -1;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fdt->fd;
+		sqe->poll32_events = want;
+		sqe->user_data = UDATA(data, URING_OP_POLL);
+	}
+
+	data->armed = 1;
+	data->armedevents = want;
+
+	return 0;
+}
+
+static int ur_readv(nbio_t *nb, nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt)
+{
+	struct urfdtdata *data = (struct urfdtdata *)fdt->intdata;
+	int i, n, rr;
+
+	if (data->rxbid == -1) {
+
+		if (data->rxerr) {
+			errno = data->rxerr;
+			data->rxerr = 0;
+			markdirty(data);
+			return -1;
+		}
+
+		if (data->rxeof)
+			return 0;
+
+		if (!data->reading && !data->ringrx)
+			return fdt_readv(fdt, iov, iovcnt);
+
+		/* The next read is queued from arm() */
+		if (!data->reading)
+			markdirty(data);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	for (i = 0, rr = 0; (i < iovcnt) && (data->rxoff < data->rxlen); i++) {
+
+		n = data->rxlen - data->rxoff;
+		if (n > iov[i].len)
+			n = iov[i].len;
+
+		memcpy(iov[i].data, data->und->rxbufs + data->rxbid * URING_RXBUFLEN + data->rxoff, n);
+		data->rxoff += n;
+		rr += n;
+	}
+
+	if (data->rxoff >= data->rxlen) {
+		freebid(data->und, data->rxbid);
+		data->rxbid = -1;
+	}
+
+	/* Like a socket that's still readable, or to queue the next read */
+	markdirty(data);
+
+	return rr;
+}
+
+static int ur_writev(nbio_t *nb, nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt)
+{
+	struct urfdtdata *data = (struct urfdtdata *)fdt->intdata;
+	int i, n, len;
+
+	if (!RINGTX(fdt))
+		return fdt_writev(fdt, iov, iovcnt);
+
+	if (data->txerr) {
+		errno = data->txerr;
+		data->txerr = 0;
+		return -1;
+	}
+
+	if (data->txbuf) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	for (i = 0, len = 0; (i < iovcnt) && (len < NBIO_TXIOV_BYTES); i++)
+		len += iov[i].len;
+	if (len > NBIO_TXIOV_BYTES)
+		len = NBIO_TXIOV_BYTES;
+
+	if (!(data->txbuf = nbio_bufget(nb, len)))
+		return -1;
+	data->txoff = 0;
+	data->txlen = len;
+
+	for (i = 0, len = 0; len < data->txlen; i++) {
+		n = iov[i].len;
+		if (n > data->txlen - len)
+			n = data->txlen - len;
+		memcpy(data->txbuf + len, iov[i].data, n);
+		len += n;
+	}
+
+	/* It's been taken either way; arm() tries again if the ring was full */
+	if (queuewrite(data->und, data) == -1)
+		markdirty(data);
+
+	return len;
+}
+
+static void ur_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
+{
+	struct urfdtdata *data = (struct urfdtdata *)fdt->intdata;
+	unsigned int old = data->events;
+
+	if (val)
+		data->events |= POLLIN;
+	else
+		data->events &= ~POLLIN;
+
+	update(data, old);
+
+	return;
+}
+
+static void ur_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
+{
+	struct urfdtdata *data = (struct urfdtdata *)fdt->intdata;
+	unsigned int old = data->events;
+
+	if (val)
+		data->events |= POLLOUT;
+	else
+		data->events &= ~POLLOUT;
+
+	update(data, old);
+
+	return;
+}
+
+static void ur_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
+{
+	struct urfdtdata *data = (struct urfdtdata *)fdt->intdata;
+	unsigned int old = data->events;
+
+	data->events = 0;
+
+	update(data, old);
+
+	return;
+}
+
+static int ur_pfdadd(nbio_t *nb, nbio_fd_t *newfd)
+{
+	struct urfdtdata *data;
+
+	if (!(data = __nbio_slaballoc(nb, sizeof(struct urfdtdata))))
+		return -1;
+	memset(data, 0, sizeof(struct urfdtdata));
+	newfd->intdata = (void *)data;
+
+	data->fdt = newfd;
+	data->und = (struct urnbdata *)nb->intdata;
+	data->rxbid = -1;
+	data->txfd = -1;
+
+	return 0;
+}
+
+static void ur_pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
+{
+
+	markdirty((struct urfdtdata *)newfd->intdata);
+
+	return;
+}
+
+static void ur_pfdrem(nbio_t *nb, nbio_fd_t *fdt)
+{
+	struct urfdtdata *data = (struct urfdtdata *)fdt->intdata;
+
+	if (!data)
+		return;
+
+	data->removed = 1;
+	markdirty(data);
+
+	/*
+	 * The application has had its WRITE events for what's still being
+	 * written, so that's finished with a dup of the fd.  The one about to
+	 * be closed (and its number maybe reused) is in the write that
+	 * streamwrite queued this pass, so that has to reach the kernel first.
+	 */
+	if (data->txbuf) {
+		data->txfd = dup(fdt->fd);
+		if (!data->writing)
+			queuewrite(data->und, data);
+		if (data->writing && tosubmit(data->und))
+			submit(data->und);
+	}
+
+	return;
+}
+
+static void ur_pfdfree(nbio_fd_t *fdt)
+{
+	struct urfdtdata *data = (struct urfdtdata *)fdt->intdata;
+
+	fdt->intdata = NULL;
+
+	if (!data)
+		return;
+
+	if (data->rxbid != -1) {
+		freebid(data->und, data->rxbid);
+		data->rxbid = -1;
+	}
+
+	/*
+	 * The kernel (or the dirty list) still knows about this one; it
+	 * is freed once its last completion has been reaped.
+	 */
+	if (data->armed || data->dirty || data->reading || data->txbuf) {
+		data->fdt = NULL;
+		data->nextorphan = data->und->orphans;
+		data->und->orphans = data;
+		return;
+	}
+
+	__nbio_slabfree((nbio_t *)fdt->nb, data, sizeof(struct urfdtdata));
+
+	return;
+}
+
+static void freeorphans(struct urnbdata *und, int all)
+{
+	struct urfdtdata *cur, **prev;
+
+	for (prev = &und->orphans; (cur = *prev); ) {
+
+		if (all || (!cur->armed && !cur->dirty && !cur->reading && !cur->txbuf)) {
+			*prev = cur->nextorphan;
+			if (cur->txbuf)
+				nbio_bufrelease(und->nb, cur->txbuf);
+			if (cur->txfd != -1)
+				close(cur->txfd);
+			__nbio_slabfree(und->nb, cur, sizeof(struct urfdtdata));
+			continue;
+		}
+
+		prev = &cur->nextorphan;
+	}
+
+	return;
+}
+
+static void unmaprings(struct urnbdata *und)
+{
+
+	if (und->sqes)
+		munmap(und->sqes, und->sqessz);
+	if (und->cqring && (und->cqring != und->sqring))
+		munmap(und->cqring, und->cqringsz);
+	if (und->sqring)
+		munmap(und->sqring, und->sqringsz);
+
+	return;
+}
+
+static int ur_pfdinit(nbio_t *nb, int pfdsize)
+{
+	struct urnbdata *und;
+	struct io_uring_params p;
+	unsigned int entries;
+	int sav;
+
+	if (!(und = nb->intdata = malloc(sizeof(struct urnbdata))))
+		return -1;
+	memset(und, 0, sizeof(struct urnbdata));
+	und->nb = nb;
+
+	entries = (pfdsize > URING_MAXENTRIES) ? URING_MAXENTRIES : pfdsize;
+
+	memset(&p, 0, sizeof(p));
+	if ((und->ringfd = sys_io_uring_setup(entries, &p)) == -1)
+		goto fail;
+
+	und->features = p.features;
+
+	und->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	und->cqringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (und->cqringsz > und->sqringsz)
+			und->sqringsz = und->cqringsz;
+		und->cqringsz = und->sqringsz;
+	}
+
+	if ((und->sqring = mmap(NULL, und->sqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, und->ringfd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		und->sqring = NULL;
+		goto failfd;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		und->cqring = und->sqring;
+	else if ((und->cqring = mmap(NULL, und->cqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, und->ringfd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		und->cqring = NULL;
+		goto failmap;
+	}
+
+	und->sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((und->sqes = mmap(NULL, und->sqessz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, und->ringfd, IORING_OFF_SQES)) == MAP_FAILED) {
+		und->sqes = NULL;
+		goto failmap;
+	}
+
+	und->sqhead = (unsigned int *)((char *)und->sqring + p.sq_off.head);
+	und->sqtail = (unsigned int *)((char *)und->sqring + p.sq_off.tail);
+	und->sqmask = (unsigned int *)((char *)und->sqring + p.sq_off.ring_mask);
+	und->sqentries = (unsigned int *)((char *)und->sqring + p.sq_off.ring_entries);
+	und->sqarray = (unsigned int *)((char *)und->sqring + p.sq_off.array);
+	und->sqlocaltail = *und->sqtail;
+
+	und->cqhead = (unsigned int *)((char *)und->cqring + p.cq_off.head);
+	und->cqtail = (unsigned int *)((char *)und->cqring + p.cq_off.tail);
+	und->cqmask = (unsigned int *)((char *)und->cqring + p.cq_off.ring_mask);
+	und->cqes = (struct io_uring_cqe *)((char *)und->cqring + p.cq_off.cqes);
+
+	und->nrxbufs = (pfdsize > URING_RXBUFS) ? URING_RXBUFS : pfdsize;
+	if (!(und->freebids = malloc(und->nrxbufs * sizeof(int)))) {
+		errno = ENOMEM;
+		goto failmap;
+	}
+	if (!(und->rxbufs = nbio_bufget(nb, und->nrxbufs * URING_RXBUFLEN)))
+		goto failbids;
+
+	/* They go in ahead of the first reads */
+	und->rxring = 1;
+	queueprovide(und, 0, und->nrxbufs);
+
+	return 0;
+
+failbids:
+	sav = errno;
+	free(und->freebids);
+	errno = sav;
+failmap:
+	sav = errno;
+	unmaprings(und);
+	errno = sav;
+failfd:
+	sav = errno;
+	close(und->ringfd);
+	errno = sav;
+fail:
+	sav = errno;
+	free(und);
+	nb->intdata = NULL;
+	errno = sav;
+
+	return -1;
+}
+
+static void ur_pfdkill(nbio_t *nb)
+{
+	struct urnbdata *und = (struct urnbdata *)nb->intdata;
+
+	/* closing the ring cancels everything still in flight */
+	close(und->ringfd);
+	unmaprings(und);
+
+	freeorphans(und, 1);
+
+	nbio_bufrelease(nb, und->rxbufs);
+	free(und->freebids);
+
+	free(und);
+
+	nb->intdata = NULL;
+
+	return;
+}
+
+static int reapread(nbio_t *nb, struct urnbdata *und, struct urfdtdata *data, struct io_uring_cqe *cqe)
+{
+	int bid = -1;
+
+	data->reading = 0;
+	data->rcancelling = 0;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+	if (!data->fdt || data->removed) {
+		if (bid != -1)
+			freebid(und, bid);
+		return 0;
+	}
+
+	if ((cqe->res == -ENOBUFS) || (cqe->res == -EINVAL) || (cqe->res == -ECANCELED)) {
+
+		/* Every buffer is sitting on some stream; read() until one's back */
+		if (cqe->res == -ENOBUFS)
+			data->pollrx = 1;
+
+		/* Too old a kernel for buffer selection */
+		if (cqe->res == -EINVAL)
+			und->rxring = 0;
+
+		/* (or, it went raw) */
+		data->ringrx = 0;
+		markdirty(data);
+		return 0;
+	}
+
+	if (cqe->res < 0)
+		data->rxerr = -cqe->res;
+	else if (cqe->res == 0)
+		data->rxeof = 1;
+
+	if (bid != -1) {
+		if (cqe->res > 0) {
+			data->rxbid = bid;
+			data->rxoff = 0;
+			data->rxlen = cqe->res;
+		} else
+			freebid(und, bid);
+	}
+
+	if (!(data->events & POLLIN) || !RINGRX(und, data->fdt))
+		return 0;
+
+	__fdt_queueready(nb, data->fdt, NBIO_READY_IN);
+
+	return 1;
+}
+
+static int reapwrite(nbio_t *nb, struct urnbdata *und, struct urfdtdata *data, struct io_uring_cqe *cqe)
+{
+
+	data->writing = 0;
+
+	if ((cqe->res == -ENOTSOCK) && !data->notsock) {
+		data->notsock = 1;
+		markdirty(data);
+		return 0;
+	}
+
+	/* short; the rest goes from arm() */
+	if ((cqe->res >= 0) && (data->txoff + cqe->res < data->txlen) &&
+			((data->fdt && !data->removed) || (data->txfd != -1))) {
+		data->txoff += cqe->res;
+		markdirty(data);
+		return 0;
+	}
+
+	nbio_bufrelease(nb, data->txbuf);
+	data->txbuf = NULL;
+
+	if (data->txfd != -1) {
+		close(data->txfd);
+		data->txfd = -1;
+	}
+
+	if (!data->fdt || data->removed)
+		return 0;
+
+	/* for the next ur_writev */
+	if (cqe->res < 0)
+		data->txerr = -cqe->res;
+
+	if (!(data->events & POLLOUT))
+		return 0;
+
+	__fdt_queueready(nb, data->fdt, NBIO_READY_OUT);
+
+	return 1;
+}
+
+static int reap(nbio_t *nb, struct urnbdata *und)
+{
+	unsigned int head, tail;
+	int nready = 0;
+
+	head = *und->cqhead;
+	tail = __atomic_load_n(und->cqtail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = und->cqes + (head & *und->cqmask);
+		struct urfdtdata *data;
+		int events = 0;
+
+		if (cqe->user_data == URING_UDATA_IGNORE)
+			continue;
+
+		if (cqe->user_data == URING_UDATA_PROVIDE) {
+			if (cqe->res < 0)
+				und->rxring = 0;
+			continue;
+		}
+
+		data = (struct urfdtdata *)(unsigned long)(cqe->user_data & ~(unsigned long long)URING_OP_MASK);
+
+		if ((cqe->user_data & URING_OP_MASK) == URING_OP_READ) {
+			nready += reapread(nb, und, data, cqe);
+			continue;
+		} else if ((cqe->user_data & URING_OP_MASK) == URING_OP_WRITE) {
+			nready += reapwrite(nb, und, data, cqe);
+			continue;
+		}
+
+		data->armed = 0;
+		data->cancelling = 0;
+
+		if (!data->fdt || data->removed)
+			continue;
+
+		/* cancelled because the mask changed */
+		if (cqe->res == -ECANCELED) {
+			markdirty(data);
+			continue;
+		}
+
+		/*
+		 * The poll itself failed (eg, EBADF).  Re-arming would fail the
+		 * same way on every pass, so let the fdt find out instead; it's
+		 * armed again if its mask changes.
+		 */
+		if (cqe->res < 0) {
+			__fdt_queueready(nb, data->fdt, NBIO_READY_EOF);
+			nready++;
+			continue;
+		}
+
+		/*
+		 * Nothing that was asked for (a half-close shows up as POLLRDHUP
+		 * whether it was or not).  Re-arming would just complete again
+		 * straight away, so leave it until the mask changes.
+		 */
+		if (!(cqe->res & (data->armedevents | POLLERR | POLLNVAL)))
+			continue;
+
+		/* one-shot, so it always needs to be re-armed */
+		markdirty(data);
+
+		/* a buffer may be free by now; try the ring again */
+		data->pollrx = 0;
+
+		if (cqe->res & POLLIN)
+			events |= NBIO_READY_IN;
+		if (cqe->res & POLLOUT)
+			events |= NBIO_READY_OUT;
+		if (cqe->res & (POLLERR | POLLHUP | POLLNVAL))
+			events |= NBIO_READY_EOF;
+
+		__fdt_queueready(nb, data->fdt, events);
+		nready++;
+	}
+
+	__atomic_store_n(und->cqhead, head, __ATOMIC_RELEASE);
+
+	return nready;
+}
+
+static int ur_pfdpoll(nbio_t *nb, int timeout)
+{
+	struct urnbdata *und;
+	struct urfdtdata *data, *next;
+	struct io_uring_getevents_arg arg;
+	unsigned int flags = 0, mincomplete = 0;
+	int nready, stalled = 0;
+
+	if (!nb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	und = (struct urnbdata *)nb->intdata;
+
+	/* Emptied read buffers go back before anything reads into them */
+	while (und->nfreebids) {
+		if (queueprovide(und, und->freebids[und->nfreebids - 1], 1) == -1)
+			break;
+		und->nfreebids--;
+	}
+
+	data = und->dirty;
+	und->dirty = NULL;
+	for (; data; data = next) {
+		next = data->nextdirty;
+		data->dirty = 0;
+		if (arm(und, data) == -1)
+			break;
+	}
+
+	/*
+	 * The ring was full and io_uring_enter wouldn't take what was in it.
+	 * Everything not armed yet stays dirty for the next pass, and this
+	 * one doesn't wait, so that it comes round again straight away.
+	 */
+	if (data) {
+		int sav = errno;
+
+		for (; data; data = next) {
+			next = data->nextdirty;
+			data->dirty = 0;
+			markdirty(data);
+		}
+
+		if ((sav != EAGAIN) && (sav != EBUSY) && (sav != EINTR)) {
+			errno = sav;
+			return -1;
+		}
+
+		stalled = 1;
+	}
+
+	timeout = stalled ? 0 : __nbio_polltimeout(nb, timeout);
+
+	if (timeout > 0) {
+		und->ts.tv_sec = timeout / 1000;
+		und->ts.tv_nsec = (timeout % 1000) * 1000000;
+	}
+
+	if (timeout != 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+		mincomplete = 1;
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	if ((timeout > 0) && (und->features & IORING_FEAT_EXT_ARG)) {
+		arg.ts = (unsigned long)&und->ts;
+		arg.sigmask_sz = _NSIG / 8;
+		flags |= IORING_ENTER_EXT_ARG;
+	} else if (timeout > 0) {
+		struct io_uring_sqe *sqe;
+
+		/* Older kernels: finishes after one completion or the timeout */
+		if ((sqe = getsqe(und))) {
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (unsigned long)&und->ts;
+			sqe->len = 1;
+			sqe->off = 1;
+			sqe->user_data = URING_UDATA_IGNORE;
+		}
+	}
+
+	__atomic_store_n(und->sqtail, und->sqlocaltail, __ATOMIC_RELEASE);
+
+	errno = 0;
+	if (sys_io_uring_enter(und->ringfd, tosubmit(und), mincomplete, flags,
+			       (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+			       (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0) == -1) {
+
+		/* Never return EINTR from nbio_poll... */
+		if ((errno == EINTR) || (errno == ETIME)) {
+			errno = 0;
+			/* completions may still have arrived */
+		} else if ((errno != EAGAIN) && (errno != EBUSY))
+			return -1;
+	}
+
+	nready = reap(nb, und);
+
+	if (__nbio_dispatch(nb) == -1)
+		return -1;
+
+	/*
+	 * Writes the handlers just had WRITE events for go to the kernel
+	 * before nbio_poll returns, as they would with write().  That's one
+	 * more io_uring_enter for all of them; if it's refused, they go with
+	 * the next pass's.
+	 */
+	if (tosubmit(und) && (submit(und) == -1) &&
+			(errno != EAGAIN) && (errno != EBUSY) && (errno != EINTR))
+		return -1;
+
+	freeorphans(und, 0);
+
+	return nready;
+}
+
+const struct nbio__backend __nbio_backend_uring = {
+	NBIO_BACKEND_URING, "uring",
+	ur_pfdinit, ur_pfdkill,
+	ur_pfdadd, ur_pfdaddfinish, ur_pfdrem, ur_pfdfree,
+	ur_pfdpoll,
+	ur_setpollin, ur_setpollout, ur_setpollnone,
+	NULL, /* no edge-triggered mode */
+	ur_readv, ur_writev
+};
+
+#endif /* def HAVE_LINUX_IO_URING_H && !def NBIO_USE_WINSOCK2 */
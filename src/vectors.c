@@ -44,6 +44,7 @@ static nbio_buf_t *getrxbuf(nbio_fd_t *fdt)
 
 	ret = fdt->rxchain_freelist;
 	fdt->rxchain_freelist = fdt->rxchain_freelist->next;
+	fdt->rxfree--;
 
 	return ret;
 }
@@ -59,52 +60,142 @@ static nbio_buf_t *gettxbuf(nbio_fd_t *fdt)
 
 	ret = fdt->txchain_freelist;
 	fdt->txchain_freelist = fdt->txchain_freelist->next;
+	fdt->txfree--;
 
 	return ret;
 }
 
 static void givebackrxbuf(nbio_fd_t *fdt, nbio_buf_t *buf)
 {
+	buf->prev = NULL;
 	buf->next = fdt->rxchain_freelist;
 	fdt->rxchain_freelist = buf;
+	fdt->rxfree++;
 
 	return;
 }
 
 static void givebacktxbuf(nbio_fd_t *fdt, nbio_buf_t *buf)
 {
+	buf->prev = NULL;
 	buf->next = fdt->txchain_freelist;
 	fdt->txchain_freelist = buf;
+	fdt->txfree++;
 
 	return;
 }
 
-int nbio_addrxvector_time(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen, int offset, time_t trigger)
+/*
+ * The rx and tx chains are doubly linked, with a tail pointer, so adding
+ * to the end and taking a buffer out by its handle don't walk anything.
+ */
+static void chainappend(nbio_buf_t **head, nbio_buf_t **tail, nbio_buf_t *buf)
+{
+
+	buf->next = NULL;
+	buf->prev = *tail;
+	buf->chain = head;
+
+	if (*tail)
+		(*tail)->next = buf;
+	else
+		*head = buf;
+	*tail = buf;
+
+	return;
+}
+
+static void chainunlink(nbio_buf_t **head, nbio_buf_t **tail, nbio_buf_t *buf)
 {
-	nbio_buf_t *newbuf, *cur;
+
+	if (buf->prev)
+		buf->prev->next = buf->next;
+	else
+		*head = buf->next;
+
+	if (buf->next)
+		buf->next->prev = buf->prev;
+	else
+		*tail = buf->prev;
+
+	buf->next = buf->prev = NULL;
+	buf->chain = NULL;
+
+	return;
+}
+
+static nbio_buf_t *chainfind(nbio_buf_t *chain, unsigned char *data)
+{
+	nbio_buf_t *cur;
+
+	for (cur = chain; cur; cur = cur->next) {
+		if (cur->data == data)
+			return cur;
+	}
+
+	return NULL;
+}
+
+static void rxunlinked(nbio_t *nb, nbio_fd_t *fdt, nbio_buf_t *buf)
+{
+
+	givebackrxbuf(fdt, buf);
+	fdt->rxqueued--;
+
+	if (!fdt->rxchain && !fdt->framing && !fdt->rxpoollen &&
+			!(fdt->flags & NBIO_FDT_FLAG_SHAREDRX))
+		fdt_setpollin(nb, fdt, 0);
+
+	return;
+}
+
+static void txunlinked(nbio_t *nb, nbio_fd_t *fdt, nbio_buf_t *buf)
+{
+
+	fdt->txbytes -= (buf->offset < buf->len) ? buf->len - buf->offset : 0;
+	__fdt_txcheck(nb, fdt);
+
+	givebacktxbuf(fdt, buf);
+	fdt->txqueued--;
+
+	if (!fdt->txchain) {
+		fdt_setpollout(nb, fdt, 0);
+		__fdt_flushcheck(nb, fdt);
+	}
+
+	return;
+}
+
+nbio_buf_t *nbio_addrxbuf(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen, int offset, time_t trigger)
+{
+	nbio_buf_t *newbuf;
 
 	if (!(newbuf = getrxbuf(fdt))) {
 		errno = ENOMEM;
-		return -1;
+		return NULL;
 	}
 
 	newbuf->data = buf;
 	newbuf->len = buflen;
 	newbuf->offset = offset;
 	newbuf->trigger = trigger;
-	newbuf->next = NULL;
+	newbuf->pooled = 0;
+
+	chainappend(&fdt->rxchain, &fdt->rxchain_tail, newbuf);
+	fdt->rxqueued++;
 
-	if (fdt->rxchain) {
-		for (cur = fdt->rxchain; cur->next; cur = cur->next)
-			;
-		cur->next = newbuf;
-	} else
-		fdt->rxchain = newbuf;
+	fdt_setpollin(nb, fdt, 1);
 
-	if (fdt->rxchain)
-		fdt_setpollin(nb, fdt, 1);
+	/* Already read, so the socket won't say it's readable again */
+	if (fdt->rxstagelen)
+		__fdt_queueready(nb, fdt, NBIO_READY_IN);
 
-	return 0;
+	return newbuf;
+}
+
+int nbio_addrxvector_time(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen, int offset, time_t trigger)
+{
+	return nbio_addrxbuf(nb, fdt, buf, buflen, offset, trigger) ? 0 : -1;
 }
 
 int nbio_addrxvector(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen, int offset)
@@ -112,40 +203,36 @@ int nbio_addrxvector(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen,
 	return nbio_addrxvector_time(nb, fdt, buf, buflen, offset, 0); /* ASAP */
 }
 
+int nbio_remrxbuf(nbio_t *nb, nbio_fd_t *fdt, nbio_buf_t *buf)
+{
+
+	/* Unlinking one that isn't there would wreck whichever chain it is on */
+	if (!fdt || !buf || (buf->chain != &fdt->rxchain)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	chainunlink(&fdt->rxchain, &fdt->rxchain_tail, buf);
+	rxunlinked(nb, fdt, buf);
+
+	return 0; /* caller must free the region */
+}
+
 int nbio_remrxvector(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf)
 {
-	nbio_buf_t *cur = NULL;
-
-	if (!fdt->rxchain)
-		;
-	else if (fdt->rxchain->data == buf) {
-		cur = fdt->rxchain;
-		fdt->rxchain = fdt->rxchain->next;
-	} else {
-		for (cur = fdt->rxchain; cur->next; cur = cur->next) {
-			if (cur->next->data == buf) {
-				nbio_buf_t *tmp;
-
-				tmp = cur->next;
-				cur->next = cur->next->next;
-				cur = tmp;
-
-				break;
-			}
-		}
+	nbio_buf_t *cur;
+
+	if (!fdt) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	if (!cur) {
+	if (!(cur = chainfind(fdt->rxchain, buf))) {
 		errno = ENOENT;
 		return -1;
 	}
 
-	givebackrxbuf(fdt, cur);
-
-	if (!fdt->rxchain)
-		fdt_setpollin(nb, fdt, 0);
-
-	return 0; /* caller must free the region */
+	return nbio_remrxbuf(nb, fdt, cur);
 }
 
 unsigned char *nbio_remtoprxvector(nbio_t *nb, nbio_fd_t *fdt, int *len, int *offset)
@@ -158,58 +245,63 @@ unsigned char *nbio_remtoprxvector(nbio_t *nb, nbio_fd_t *fdt, int *len, int *of
 		return NULL;
 	}
 
-	if (!fdt->rxchain) {
+	if (!(ret = fdt->rxchain)) {
 		errno = ENOENT;
 		return NULL;
 	}
 
-	ret = fdt->rxchain;
-	fdt->rxchain = fdt->rxchain->next;
-
 	if (len)
 		*len = ret->len;
 	if (offset)
 		*offset = ret->offset;
 	buf = ret->data;
 
-	givebackrxbuf(fdt, ret);
-
-	if (!fdt->rxchain)
-		fdt_setpollin(nb, fdt, 0);
+	chainunlink(&fdt->rxchain, &fdt->rxchain_tail, ret);
+	rxunlinked(nb, fdt, ret);
 
 	return buf;
 }
 
-int nbio_addtxvector_time(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen, time_t trigger)
+nbio_buf_t *nbio_addtxbuf(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen, time_t trigger)
 {
 	nbio_buf_t *newbuf;
 
 	if (!fdt || !buf || !buflen) {
 		errno = EINVAL;
-		return -1;
+		return NULL;
 	}
 
 	if (!(newbuf = gettxbuf(fdt))) {
 		errno = ENOMEM;
-		return -1;
+		return NULL;
 	}
 
 	newbuf->data = buf;
 	newbuf->len = buflen;
 	newbuf->offset = 0;
 	newbuf->trigger = trigger;
-	newbuf->next = NULL;
+	newbuf->pooled = 0;
 
-	if (fdt->txchain_tail) {
-		fdt->txchain_tail->next = newbuf;
-		fdt->txchain_tail = fdt->txchain_tail->next;
-	} else
-		fdt->txchain = fdt->txchain_tail = newbuf;
+	chainappend(&fdt->txchain, &fdt->txchain_tail, newbuf);
+	fdt->txqueued++;
 
-	if (fdt->txchain)
+	fdt->txbytes += buflen;
+	__fdt_txcheck(nb, fdt);
+
+	/* Not due yet, so there's no point asking if it's writable */
+	if (trigger && !nb->inpass)
+		__nbio_clockupdate(nb);
+	if (trigger > nb->now)
+		__fdt_txwait(nb, fdt, trigger);
+	else
 		fdt_setpollout(nb, fdt, 1);
 
-	return 0;
+	return newbuf;
+}
+
+int nbio_addtxvector_time(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen, time_t trigger)
+{
+	return nbio_addtxbuf(nb, fdt, buf, buflen, trigger) ? 0 : -1;
 }
 
 int nbio_addtxvector(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen)
@@ -219,53 +311,43 @@ int nbio_addtxvector(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf, int buflen)
 
 int nbio_rxavail(nbio_t *nb, nbio_fd_t *fdt)
 {
-	return !!fdt->rxchain_freelist;
+	return fdt->rxfree;
 }
 
 int nbio_txavail(nbio_t *nb, nbio_fd_t *fdt)
 {
-	return !!fdt->txchain_freelist;
+	return fdt->txfree;
 }
 
-int nbio_remtxvector(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf)
+int nbio_remtxbuf(nbio_t *nb, nbio_fd_t *fdt, nbio_buf_t *buf)
 {
-	nbio_buf_t *cur = NULL;
-
-	if (!fdt->txchain)
-		;
-	else if (fdt->txchain->data == buf) {
-		cur = fdt->txchain;
-		fdt->txchain = fdt->txchain->next;
-	} else {
-		for (cur = fdt->txchain; cur->next; cur = cur->next) {
-			if (cur->next->data == buf) {
-				nbio_buf_t *tmp;
-
-				tmp = cur->next;
-				cur->next = cur->next->next;
-				cur = tmp;
-
-				break;
-			}
-		}
-	}
 
-	if (!cur) {
-		errno = ENOENT;
+	if (!fdt || !buf || (buf->chain != &fdt->txchain)) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	if (cur == fdt->txchain_tail)
-		fdt->txchain_tail = fdt->txchain_tail->next;
-	if (!fdt->txchain_tail)
-		fdt->txchain_tail = fdt->txchain;
+	chainunlink(&fdt->txchain, &fdt->txchain_tail, buf);
+	txunlinked(nb, fdt, buf);
 
-	givebacktxbuf(fdt, cur);
+	return 0; /* caller must free the region */
+}
 
-	if (!fdt->txchain)
-		fdt_setpollout(nb, fdt, 0);
+int nbio_remtxvector(nbio_t *nb, nbio_fd_t *fdt, unsigned char *buf)
+{
+	nbio_buf_t *cur;
 
-	return 0; /* caller must free the region */
+	if (!fdt) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(cur = chainfind(fdt->txchain, buf))) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return nbio_remtxbuf(nb, fdt, cur);
 }
 
 unsigned char *nbio_remtoptxvector(nbio_t *nb, nbio_fd_t *fdt, int *len, int *offset)
@@ -278,27 +360,19 @@ unsigned char *nbio_remtoptxvector(nbio_t *nb, nbio_fd_t *fdt, int *len, int *of
 		return NULL;
 	}
 
-	if (!fdt->txchain) {
+	if (!(ret = fdt->txchain)) {
 		errno = ENOENT;
 		return NULL;
 	}
 
-	ret = fdt->txchain;
-	fdt->txchain = fdt->txchain->next;
-
-	if (ret == fdt->txchain_tail)
-		fdt->txchain_tail = fdt->txchain;
-
 	if (len)
 		*len = ret->len;
 	if (offset)
 		*offset = ret->offset;
 	buf = ret->data;
 
-	givebacktxbuf(fdt, ret);
-
-	if (!fdt->txchain)
-		fdt_setpollout(nb, fdt, 0);
+	chainunlink(&fdt->txchain, &fdt->txchain_tail, ret);
+	txunlinked(nb, fdt, ret);
 
 	return buf;
 }
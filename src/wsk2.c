@@ -104,6 +104,28 @@ int fdt_read(nbio_fd_t *fdt, void *buf, int count)
 	return fdt_readfd(fdt->fd, buf, count);
 }
 
+int fdt_readv(nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt)
+{
+	WSABUF vec[NBIO_IOV_MAX];
+	DWORD got = 0, flags = 0;
+	int i;
+
+	if (iovcnt > NBIO_IOV_MAX)
+		iovcnt = NBIO_IOV_MAX;
+
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].buf = (char *)iov[i].data;
+		vec[i].len = iov[i].len;
+	}
+
+	if (WSARecv(fdt->fd, vec, iovcnt, &got, &flags, NULL, NULL) == SOCKET_ERROR) {
+		wsa_seterrno();
+		return -1;
+	}
+
+	return (int)got;
+}
+
 int fdt_writefd(nbio_sockfd_t fd, const void *buf, int count)
 {
 	int ret;
@@ -121,6 +143,28 @@ int fdt_write(nbio_fd_t *fdt, const void *buf, int count)
 	return fdt_writefd(fdt->fd, buf, count);
 }
 
+int fdt_writev(nbio_fd_t *fdt, const fdt_iovec_t *iov, int iovcnt)
+{
+	WSABUF vec[NBIO_IOV_MAX];
+	DWORD sent = 0;
+	int i;
+
+	if (iovcnt > NBIO_IOV_MAX)
+		iovcnt = NBIO_IOV_MAX;
+
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].buf = (char *)iov[i].data;
+		vec[i].len = iov[i].len;
+	}
+
+	if (WSASend(fdt->fd, vec, iovcnt, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+		wsa_seterrno();
+		return -1;
+	}
+
+	return (int)sent;
+}
+
 int fdt_closefd(nbio_sockfd_t fd)
 {
 	return closesocket(fd);
@@ -169,7 +213,7 @@ struct nbdata {
 	int maxfd;
 };
 
-int pfdinit(nbio_t *nb, int pfdsize)
+static int wsk_pfdinit(nbio_t *nb, int pfdsize)
 {
 	struct nbdata *nbd;
 
@@ -187,7 +231,7 @@ int pfdinit(nbio_t *nb, int pfdsize)
 }
 
 /* This kills the nbio_t, not a pfd -- confusing name. */
-void pfdkill(nbio_t *nb)
+static void wsk_pfdkill(nbio_t *nb)
 {
 	struct nbdata *nbd = (struct nbdata *)nb->intdata;
 
@@ -229,12 +273,12 @@ static int setmaxfd(nbio_t *nb)
 	return maxfd;
 }
 
-int pfdadd(nbio_t *nb, nbio_fd_t *newfd)
+static int wsk_pfdadd(nbio_t *nb, nbio_fd_t *newfd)
 {
 	struct nbdata *nbd = (struct nbdata *)nb->intdata;
 	struct fdtdata *data;
 
-	if (!(data = malloc(sizeof(struct fdtdata))))
+	if (!(data = __nbio_slaballoc(nb, sizeof(struct fdtdata))))
 		return -1;
 	memset(data, 0, sizeof(struct fdtdata));
 	newfd->intdata = (void *)data;
@@ -244,7 +288,7 @@ int pfdadd(nbio_t *nb, nbio_fd_t *newfd)
 	return 0;
 }
 
-void pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
+static void wsk_pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
 {
 
 	setmaxfd(nb);
@@ -252,7 +296,7 @@ void pfdaddfinish(nbio_t *nb, nbio_fd_t *newfd)
 	return;
 }
 
-void pfdrem(nbio_t *nb, nbio_fd_t *fdt)
+static void wsk_pfdrem(nbio_t *nb, nbio_fd_t *fdt)
 {
 
 	setmaxfd(nb);
@@ -260,21 +304,21 @@ void pfdrem(nbio_t *nb, nbio_fd_t *fdt)
 	return;
 }
 
-void pfdfree(nbio_fd_t *fdt)
+static void wsk_pfdfree(nbio_fd_t *fdt)
 {
 	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
 
-	free(data);
+	__nbio_slabfree((nbio_t *)fdt->nb, data, sizeof(struct fdtdata));
 	fdt->intdata = NULL;
 
 	return;
 }
 
-int pfdpoll(nbio_t *nb, int timeout)
+static int wsk_pfdpoll(nbio_t *nb, int timeout)
 {
 	struct nbdata *nbd = (struct nbdata *)nb->intdata;
 	int selret;
-	nbio_fd_t *cur = NULL, **prev = NULL;
+	nbio_fd_t *cur = NULL;
 	fd_set rfds, wfds;
 	struct timeval tv;
 
@@ -286,6 +330,8 @@ int pfdpoll(nbio_t *nb, int timeout)
 	FD_ZERO(&rfds);
 	FD_ZERO(&wfds);
 
+	timeout = __nbio_polltimeout(nb, timeout);
+
 	if (timeout != -1) {
 		memset(&tv, 0, sizeof(tv));
 		tv.tv_sec = timeout / 1000;
@@ -322,41 +368,32 @@ int pfdpoll(nbio_t *nb, int timeout)
 
 	}
 
-	for (prev = (nbio_fd_t **)&nb->fdlist; (cur = *prev); ) {
-		struct fdtdata *data = (struct fdtdata *)cur->intdata;
+	/*
+	 * Winsock's fd_sets are arrays of handles rather than bitmaps, so
+	 * there's no cheaper way to go from the sets back to the fdts.
+	 */
+	for (cur = (nbio_fd_t *)nb->fdlist; cur && (selret > 0); cur = cur->next) {
+		int events = 0;
 
-		if ((cur->flags & NBIO_FDT_FLAG_CLOSED) || !data) {
-			*prev = cur->next;
-			__fdt_free(cur);
+		if ((cur->flags & NBIO_FDT_FLAG_CLOSED) || !cur->intdata)
 			continue;
-		}
 
-		/*
-		 * Remember that the __fdt_ready_*() functions can close
-		 * connections.
-		 */
-		if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
-					FD_ISSET(cur->fd, &rfds)) {
-			if (__fdt_ready_in(nb, cur) == -1)
-				return -1;
-		}
-
-		if (!(cur->flags & NBIO_FDT_FLAG_CLOSED) &&
-					FD_ISSET(cur->fd, &wfds)) {
-			if (__fdt_ready_out(nb, cur) == -1)
-				return -1;
-		}
+		if (FD_ISSET(cur->fd, &rfds))
+			events |= NBIO_READY_IN;
+		if (FD_ISSET(cur->fd, &wfds))
+			events |= NBIO_READY_OUT;
 
-		if (__fdt_ready_all(nb, cur) == -1)
-			return -1;
-
-		prev = &cur->next;
+		if (events)
+			__fdt_queueready(nb, cur, events);
 	}
 
-	return 1;
+	if (__nbio_dispatch(nb) == -1)
+		return -1;
+
+	return selret;
 }
 
-void fdt_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
+static void wsk_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
 {
 	struct nbdata *nbd = (struct nbdata *)nb->intdata;
 	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
@@ -371,7 +408,7 @@ void fdt_setpollin(nbio_t *nb, nbio_fd_t *fdt, int val)
 	return;
 }
 
-void fdt_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
+static void wsk_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
 {
 	struct nbdata *nbd = (struct nbdata *)nb->intdata;
 	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
@@ -386,7 +423,7 @@ void fdt_setpollout(nbio_t *nb, nbio_fd_t *fdt, int val)
 	return;
 }
 
-void fdt_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
+static void wsk_setpollnone(nbio_t *nb, nbio_fd_t *fdt)
 {
 	struct nbdata *nbd = (struct nbdata *)nb->intdata;
 	struct fdtdata *data = (struct fdtdata *)fdt->intdata;
@@ -454,7 +491,7 @@ static int fdt_connect_handler(void *nbv, int event, nbio_fd_t *fdt)
 		return -1;
 	}
 
-	fdt->fd = -1; /* prevent it from being close()'d by closefdt */
+	__fdt_detachfd(nb, fdt); /* prevent it from being close()'d by closefdt */
 
 	free(ci);
 	fdt->flags &= ~NBIO_FDT_FLAG_IGNORE;
@@ -535,6 +572,22 @@ nbio_sockfd_t fdt_acceptfd(nbio_sockfd_t fd, struct sockaddr *saret, int *salen)
 	return ret;
 }
 
+/* Sockets aren't inherited here unless asked for, so just non-blocking */
+nbio_sockfd_t fdt_acceptnb(nbio_sockfd_t fd, struct sockaddr *saret, int *salen)
+{
+	nbio_sockfd_t newfd;
+
+	if ((newfd = fdt_acceptfd(fd, saret, salen)) == INVALID_SOCKET)
+		return newfd;
+
+	if (fdt_setnonblock(newfd) == -1) {
+		closesocket(newfd);
+		return INVALID_SOCKET;
+	}
+
+	return newfd;
+}
+
 int fdt_bindfd(nbio_sockfd_t fd, struct sockaddr *sa, int salen)
 {
 	int ret;
@@ -588,5 +641,15 @@ nbio_sockfd_t fdt_newlistener(const char *addr, unsigned short portnum)
 	return sfd;
 }
 
+const struct nbio__backend __nbio_backend_wsk2 = {
+	NBIO_BACKEND_WINSOCK2, "winsock2",
+	wsk_pfdinit, wsk_pfdkill,
+	wsk_pfdadd, wsk_pfdaddfinish, wsk_pfdrem, wsk_pfdfree,
+	wsk_pfdpoll,
+	wsk_setpollin, wsk_setpollout, wsk_setpollnone,
+	NULL, /* no edge-triggered mode */
+	NULL, NULL
+};
+
 #endif /* NBIO_USE_WINSOCK2 */
 
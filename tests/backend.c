@@ -0,0 +1,296 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * The same streams, run on every backend that's built in: reads, writes,
+ * EOF (with a read queued, since not every backend hears a hangup
+ * otherwise), the same again in edge mode where the backend can do it, and
+ * closing an fdt while its interest changes are still waiting to go to
+ * the kernel (kqueue batches them into the next kevent()).  The fd gets
+ * reused straight after, so a change left behind for it would show.
+ *
+ */
+
+#include "tests.h"
+
+static const struct {
+	int id;
+	const char *name;
+	int edge;
+} backends[] = {
+	{ NBIO_BACKEND_POLL, "poll", 0 },
+	{ NBIO_BACKEND_SELECT, "select", 0 },
+	{ NBIO_BACKEND_EPOLL, "epoll", 1 },
+	{ NBIO_BACKEND_KQUEUE, "kqueue", 1 },
+	{ NBIO_BACKEND_URING, "uring", 0 },
+};
+
+static int reads, writes, eofs;
+static unsigned char got[64];
+static int gotlen;
+
+/* A handler with a priv closes the stream from its first read */
+static int handler(void *nbv, int event, nbio_fd_t *fdt)
+{
+	nbio_t *nb = (nbio_t *)nbv;
+	static unsigned char reply[] = "reply";
+
+	if (event == NBIO_EVENT_READ) {
+		unsigned char *buf;
+		int len, offset;
+
+		if (!(buf = nbio_remtoprxvector(nb, fdt, &len, &offset)))
+			return 0;
+		reads++;
+		if (gotlen + offset <= (int)sizeof(got)) {
+			memcpy(got + gotlen, buf, offset);
+			gotlen += offset;
+		}
+
+		if (fdt->priv) {
+			nbio_addtxvector(nb, fdt, reply, sizeof(reply) - 1);
+			nbio_closefdt(nb, fdt);
+		}
+
+	} else if (event == NBIO_EVENT_WRITE) {
+		if (nbio_remtoptxvector(nb, fdt, NULL, NULL))
+			writes++;
+
+	} else if ((event == NBIO_EVENT_EOF) || (event == NBIO_EVENT_ERROR)) {
+		eofs++;
+		nbio_closefdt(nb, fdt);
+	}
+
+	return 0;
+}
+
+static void reset(void)
+{
+
+	reads = writes = eofs = 0;
+	gotlen = 0;
+	memset(got, 0, sizeof(got));
+
+	return;
+}
+
+static nbio_fd_t *addstream(nbio_t *nb, int fd, int edge, void *priv)
+{
+	nbio_fd_t *fdt;
+
+	fdt = nbio_addfd(nb, NBIO_FDTYPE_STREAM, fd, 0, handler, priv, 4, 4);
+	CHECK(fdt != NULL);
+	if (fdt && edge)
+		CHECK(nbio_setedge(nb, fdt, 1) == 0);
+
+	return fdt;
+}
+
+/* Whatever the peer has waiting, without blocking; 0 is EOF */
+static int peerread(int fd, unsigned char *buf, int len)
+{
+
+	return recv(fd, buf, len, MSG_DONTWAIT);
+}
+
+static void readwrite(nbio_t *nb, int edge)
+{
+	static unsigned char rx[3][5], tx[] = "world";
+	unsigned char buf[16];
+	nbio_fd_t *fdt;
+	int sv[2];
+
+	testpair(sv);
+	fdt = addstream(nb, sv[0], edge, NULL);
+	reset();
+
+	/* One write's worth across two buffers, in one pass */
+	nbio_addrxvector(nb, fdt, rx[0], 5, 0);
+	nbio_addrxvector(nb, fdt, rx[1], 5, 0);
+	CHECK(write(sv[1], "helloagain", 10) == 10);
+	testpump(nb);
+	CHECK((reads == 2) && (gotlen == 10) && (memcmp(got, "helloagain", 10) == 0));
+
+	/* Data with nowhere to go yet, then somewhere */
+	CHECK(write(sv[1], "later", 5) == 5);
+	testpump(nb);
+	CHECK(reads == 2);
+	nbio_addrxvector(nb, fdt, rx[2], 5, 0);
+	testpump(nb);
+	CHECK((reads == 3) && (memcmp(got + 10, "later", 5) == 0));
+
+	nbio_addtxvector(nb, fdt, tx, 5);
+	testpump(nb);
+	CHECK(writes == 1);
+	CHECK((peerread(sv[1], buf, sizeof(buf)) == 5) && (memcmp(buf, "world", 5) == 0));
+
+	/* Nothing queued either way, so nothing more happens */
+	testpump(nb);
+	CHECK((reads == 3) && (writes == 1) && (eofs == 0));
+
+	nbio_addrxvector(nb, fdt, rx[0], 5, 0);
+	close(sv[1]);
+	testpump(nb);
+	CHECK((reads == 3) && (eofs == 1));
+
+	return;
+}
+
+/*
+ * A new stream on a number that was just closed has to start from
+ * scratch: its data read, and nothing else (like a write the old one
+ * wanted) going on once that's done.
+ */
+static void reuse(nbio_t *nb, int edge, int oldfd)
+{
+	static unsigned char rx[2][5];
+	nbio_fd_t *fdt;
+	int sv[2];
+
+	testpair(sv);
+	CHECK(sv[0] == oldfd);
+	fdt = addstream(nb, sv[0], edge, NULL);
+	reset();
+	nbio_addrxvector(nb, fdt, rx[0], 5, 0);
+	CHECK(write(sv[1], "fresh", 5) == 5);
+	testpump(nb);
+	CHECK((reads == 1) && (writes == 0) && (memcmp(got, "fresh", 5) == 0));
+	CHECK(nbio_poll(nb, 0) == 0);
+
+	nbio_addrxvector(nb, fdt, rx[1], 5, 0);
+	close(sv[1]);
+	testpump(nb);
+	CHECK((reads == 1) && (eofs == 1));
+
+	return;
+}
+
+static void closepending(nbio_t *nb, int edge)
+{
+	static unsigned char rx[5], tx[] = "never";
+	unsigned char buf[16];
+	nbio_fd_t *fdt;
+	int sv[2], oldfd;
+
+	/* Interest in both directions, and closed before the backend hears of it */
+	testpair(sv);
+	oldfd = sv[0];
+	fdt = addstream(nb, sv[0], edge, NULL);
+	reset();
+	nbio_addrxvector(nb, fdt, rx, 5, 0);
+	nbio_addtxvector(nb, fdt, tx, 5);
+	CHECK(nbio_closefdt(nb, fdt) == 0);
+	CHECK(peerread(sv[1], buf, sizeof(buf)) == 0);
+	close(sv[1]);
+	reuse(nb, edge, oldfd);
+
+	/* Closed from its handler, with a write it just asked for */
+	testpair(sv);
+	fdt = addstream(nb, sv[0], edge, (void *)1);
+	reset();
+	nbio_addrxvector(nb, fdt, rx, 5, 0);
+	CHECK(write(sv[1], "first", 5) == 5);
+	testpump(nb);
+	CHECK((reads == 1) && (writes == 0) && (eofs == 0));
+	CHECK(peerread(sv[1], buf, sizeof(buf)) == 0);
+	close(sv[1]);
+	reuse(nb, edge, oldfd);
+
+	return;
+}
+
+static int conform(int i)
+{
+	nbio_t nb;
+	int before = failures;
+
+	if (nbio_init_ex(&nb, 64, backends[i].id) == -1) {
+		printf("%s: not available (%s)\n", backends[i].name, strerror(errno));
+		return 0;
+	}
+
+	/* $NBIO_BACKEND may have picked another one instead */
+	if (nbio_getbackend(&nb) != backends[i].id) {
+		nbio_kill(&nb);
+		return 0;
+	}
+
+	readwrite(&nb, 0);
+	closepending(&nb, 0);
+
+	if (backends[i].edge) {
+		readwrite(&nb, 1);
+		closepending(&nb, 1);
+	} else {
+		nbio_fd_t *fdt;
+		int sv[2];
+
+		testpair(sv);
+		fdt = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sv[0], 0, handler, NULL, 4, 4);
+		errno = 0;
+		CHECK((nbio_setedge(&nb, fdt, 1) == -1) && (errno == ENOSYS));
+		nbio_closefdt(&nb, fdt);
+		close(sv[1]);
+	}
+
+	nbio_kill(&nb);
+
+	printf("%s: %s\n", backends[i].name, (failures == before) ? "ok" : "FAILED");
+
+	return 1;
+}
+
+/* $NBIO_BACKEND naming something we can't have is an error, not a fallback */
+static void envbad(void)
+{
+	const char *was;
+	char *saved = NULL;
+	nbio_t nb;
+
+	if ((was = getenv("NBIO_BACKEND")))
+		saved = strdup(was);
+
+	setenv("NBIO_BACKEND", "bogus", 1);
+	errno = 0;
+	CHECK((nbio_init(&nb, 64) == -1) && (errno == EINVAL));
+
+	setenv("NBIO_BACKEND", "winsock2", 1);
+	errno = 0;
+	CHECK((nbio_init_ex(&nb, 64, NBIO_BACKEND_POLL) == -1) && (errno == ENOSYS));
+
+	if (saved) {
+		setenv("NBIO_BACKEND", saved, 1);
+		free(saved);
+	} else
+		unsetenv("NBIO_BACKEND");
+
+	return;
+}
+
+int main(int argc, char **argv)
+{
+	int i, ran = 0;
+
+	envbad();
+
+	for (i = 0; i < (int)(sizeof(backends) / sizeof(backends[0])); i++)
+		ran += conform(i);
+	CHECK(ran > 0);
+
+	return testdone();
+}
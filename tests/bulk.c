@@ -0,0 +1,328 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Lots of data both ways on lots of streams at once, on every backend
+ * that's built in: more than fits in the socket buffers (so writes come
+ * up short), and more streams reading at once than io_uring has read
+ * buffers for.  Then a close-on-flush stream whose last write has to get
+ * there even though the fdt is closed straight after, and a stream that's
+ * a pipe rather than a socket.
+ *
+ */
+
+#include <fcntl.h>
+
+#include "tests.h"
+
+static const struct {
+	int id;
+	const char *name;
+} backends[] = {
+	{ NBIO_BACKEND_POLL, "poll" },
+	{ NBIO_BACKEND_SELECT, "select" },
+	{ NBIO_BACKEND_EPOLL, "epoll" },
+	{ NBIO_BACKEND_KQUEUE, "kqueue" },
+	{ NBIO_BACKEND_URING, "uring" },
+};
+
+#define STREAMS 80
+#define BYTES (256 * 1024)
+#define CHUNK 1024
+
+struct stream {
+	int sv[2];
+	nbio_fd_t *fdt;
+	unsigned char rx[2][CHUNK];
+	int libgot, libbad; /* what the library read, in order? */
+	int peersent, peergot, peerbad;
+	int txdone; /* WRITE events */
+	int txpooled; /* tx buffers are from nbio_bufget */
+	int closeafter; /* close from the WRITE event for the last one */
+	int eof;
+};
+
+static struct stream streams[STREAMS];
+static unsigned char txdata[4][BYTES / 4];
+
+/* The same bytes each way, different for each stream */
+static unsigned char pattern(int stream, int off)
+{
+	return (unsigned char)(off * 7 + stream * 13 + off / 251);
+}
+
+static int handler(void *nbv, int event, nbio_fd_t *fdt)
+{
+	nbio_t *nb = (nbio_t *)nbv;
+	struct stream *s = (struct stream *)fdt->priv;
+
+	if (event == NBIO_EVENT_READ) {
+		unsigned char *buf;
+		int len, offset, i;
+
+		if (!(buf = nbio_remtoprxvector(nb, fdt, &len, &offset)))
+			return 0;
+		for (i = 0; i < offset; i++) {
+			if (buf[i] != pattern(s - streams, s->libgot + i))
+				s->libbad++;
+		}
+		s->libgot += offset;
+		if (s->libgot < BYTES)
+			nbio_addrxvector(nb, fdt, buf, CHUNK, 0);
+
+	} else if (event == NBIO_EVENT_WRITE) {
+		unsigned char *buf;
+
+		if (!(buf = nbio_remtoptxvector(nb, fdt, NULL, NULL)))
+			return 0;
+		s->txdone++;
+		if (s->txpooled)
+			nbio_bufrelease(nb, buf);
+		if (s->closeafter && !fdt->txchain) {
+			s->eof++;
+			nbio_closefdt(nb, fdt);
+		}
+
+	} else if ((event == NBIO_EVENT_EOF) || (event == NBIO_EVENT_ERROR)) {
+		s->eof++;
+		nbio_closefdt(nb, fdt);
+	}
+
+	return 0;
+}
+
+/* The test's end: write some, read what's there (up to max), check it */
+static int peer(struct stream *s, int max)
+{
+	unsigned char buf[8192];
+	int i, n, busy = 0;
+
+	if (s->peersent < BYTES) {
+		n = BYTES - s->peersent;
+		if (n > (int)sizeof(buf))
+			n = sizeof(buf);
+		for (i = 0; i < n; i++)
+			buf[i] = pattern(s - streams, s->peersent + i);
+		if ((n = send(s->sv[1], buf, n, MSG_DONTWAIT)) > 0) {
+			s->peersent += n;
+			busy = 1;
+		}
+	}
+
+	while ((max > 0) && ((n = recv(s->sv[1], buf, (max < (int)sizeof(buf)) ? max : (int)sizeof(buf), MSG_DONTWAIT)) > 0)) {
+		max -= n;
+		for (i = 0; i < n; i++) {
+			if (buf[i] != pattern(s - streams, s->peergot + i))
+				s->peerbad++;
+		}
+		s->peergot += n;
+		busy = 1;
+	}
+
+	return busy;
+}
+
+static void filltx(int stream)
+{
+	int i, j;
+
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < BYTES / 4; j++)
+			txdata[i][j] = pattern(stream, i * (BYTES / 4) + j);
+	}
+
+	return;
+}
+
+static void bulk(nbio_t *nb)
+{
+	struct stream *s, *bad;
+	int i, j, pass, idle;
+
+	memset(streams, 0, sizeof(streams));
+
+	for (i = 0; i < STREAMS; i++) {
+		s = &streams[i];
+		testpair(s->sv);
+		s->fdt = nbio_addfd(nb, NBIO_FDTYPE_STREAM, s->sv[0], 0, handler, s, 2, 4);
+		CHECK(s->fdt != NULL);
+		nbio_addrxvector(nb, s->fdt, s->rx[0], CHUNK, 0);
+		nbio_addrxvector(nb, s->fdt, s->rx[1], CHUNK, 0);
+	}
+
+	/* All of the peers' data lands before anything's read */
+	for (i = 0; i < STREAMS; i++)
+		peer(&streams[i], BYTES);
+
+	/* Each stream's tx buffers are copied out of txdata in turn */
+	for (i = 0; i < STREAMS; i++) {
+		filltx(i);
+		streams[i].txpooled = 1;
+		for (j = 0; j < 4; j++) {
+			unsigned char *buf = nbio_bufget(nb, BYTES / 4);
+
+			memcpy(buf, txdata[j], BYTES / 4);
+			nbio_addtxvector(nb, streams[i].fdt, buf, BYTES / 4);
+		}
+	}
+
+	for (pass = 0, idle = 0; (pass < 100000) && (idle < 50); pass++) {
+		int busy = 0;
+
+		if (nbio_poll(nb, 1) > 0)
+			busy = 1;
+		for (i = 0; i < STREAMS; i++)
+			busy |= peer(&streams[i], BYTES);
+		idle = busy ? 0 : idle + 1;
+	}
+
+	for (i = 0, j = 0, bad = NULL; i < STREAMS; i++) {
+		s = &streams[i];
+		if ((s->libgot != BYTES) || s->libbad || (s->peergot != BYTES) ||
+				s->peerbad || (s->txdone != 4) || s->eof) {
+			if (!bad)
+				bad = s;
+			j++;
+		}
+	}
+	CHECK(j == 0);
+	if (bad)
+		printf("%d streams, eg %d: lib got %d (%d bad), peer got %d (%d bad), %d writes, %d eofs\n",
+				j, (int)(bad - streams), bad->libgot, bad->libbad,
+				bad->peergot, bad->peerbad, bad->txdone, bad->eof);
+
+	for (i = 0; i < STREAMS; i++) {
+		nbio_closefdt(nb, streams[i].fdt);
+		close(streams[i].sv[1]);
+	}
+
+	return;
+}
+
+/*
+ * Closed once it's all written (from the EOF close-on-flush sends, or
+ * straight from the last WRITE event); the peer has to get all of it.
+ */
+static void flushclose(nbio_t *nb, int closeafter)
+{
+	struct stream *s = &streams[0];
+	int j, pass;
+
+	memset(s, 0, sizeof(struct stream));
+	s->peersent = BYTES; /* nothing from this end */
+	s->closeafter = closeafter;
+
+	testpair(s->sv);
+	s->fdt = nbio_addfd(nb, NBIO_FDTYPE_STREAM, s->sv[0], 0, handler, s, 0, 4);
+	CHECK(s->fdt != NULL);
+
+	filltx(0);
+	for (j = 0; j < 4; j++)
+		nbio_addtxvector(nb, s->fdt, txdata[j], BYTES / 4);
+	if (!closeafter)
+		nbio_setcloseonflush(s->fdt, 1);
+
+	/* Slowly, so the socket buffer's full when it's closed */
+	for (pass = 0; (pass < 100000) && !s->eof; pass++) {
+		nbio_poll(nb, 1);
+		peer(s, 4096);
+	}
+	CHECK((s->eof == 1) && (s->txdone == 4));
+
+	/* what's left is the kernel's (or the ring's) to finish */
+	for (pass = 0; (pass < 1000) && (s->peergot < BYTES); pass++) {
+		nbio_poll(nb, 1);
+		peer(s, BYTES);
+	}
+	CHECK((s->peergot == BYTES) && !s->peerbad);
+
+	for (pass = 0; (pass < 1000) && (recv(s->sv[1], txdata[0], 1, MSG_DONTWAIT) != 0); pass++)
+		nbio_poll(nb, 1);
+	CHECK(pass < 1000); /* and then it's closed */
+
+	close(s->sv[1]);
+
+	return;
+}
+
+static void pipewrite(nbio_t *nb)
+{
+	static unsigned char tx[] = "through a pipe";
+	unsigned char buf[32];
+	struct stream *s = &streams[0];
+	int p[2], i, n;
+
+	memset(s, 0, sizeof(struct stream));
+
+	CHECK(pipe(p) == 0);
+	CHECK(fcntl(p[0], F_SETFL, O_NONBLOCK) == 0);
+	s->fdt = nbio_addfd(nb, NBIO_FDTYPE_STREAM, p[1], 0, handler, s, 0, 4);
+	CHECK(s->fdt != NULL);
+	nbio_addtxvector(nb, s->fdt, tx, 7);
+	nbio_addtxvector(nb, s->fdt, tx + 7, sizeof(tx) - 1 - 7);
+	for (i = 0; (i < 100) && (s->txdone < 2); i++)
+		nbio_poll(nb, 5);
+	CHECK((s->txdone == 2) && !s->eof);
+
+	/* With io_uring it may still be in the ring (and sent again as a WRITE) */
+	for (i = 0; (i < 100) && ((n = read(p[0], buf, sizeof(buf))) == -1); i++)
+		nbio_poll(nb, 5);
+	CHECK((n == sizeof(tx) - 1) && (memcmp(buf, tx, sizeof(tx) - 1) == 0));
+
+	nbio_closefdt(nb, s->fdt);
+	close(p[0]);
+
+	return;
+}
+
+static int run(int i)
+{
+	nbio_t nb;
+	int before = failures;
+
+	if (nbio_init_ex(&nb, 256, backends[i].id) == -1)
+		return 0;
+
+	/* $NBIO_BACKEND may have picked another one instead */
+	if (nbio_getbackend(&nb) != backends[i].id) {
+		nbio_kill(&nb);
+		return 0;
+	}
+
+	bulk(&nb);
+	flushclose(&nb, 0);
+	flushclose(&nb, 1);
+	pipewrite(&nb);
+
+	nbio_kill(&nb);
+
+	printf("%s: %s\n", backends[i].name, (failures == before) ? "ok" : "FAILED");
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int i, ran = 0;
+
+	for (i = 0; i < (int)(sizeof(backends) / sizeof(backends[0])); i++)
+		ran += run(i);
+	CHECK(ran > 0);
+
+	return testdone();
+}
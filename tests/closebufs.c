@@ -0,0 +1,143 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Pool buffers the library put on an rxchain itself have to go back to
+ * the pool when the stream is closed with them still there.  A released
+ * buffer is the next one nbio_bufget() hands out for that size, so that's
+ * how these tell (and LeakSanitizer, if it's built in, agrees).
+ *
+ */
+
+#include "tests.h"
+
+static int eofs;
+
+static int handler(void *nbv, int event, nbio_fd_t *fdt)
+{
+	nbio_t *nb = (nbio_t *)nbv;
+
+	if (event == NBIO_EVENT_READ) {
+		unsigned char *buf;
+		int len, offset;
+
+		if ((buf = nbio_remtoprxvector(nb, fdt, &len, &offset)))
+			nbio_bufrelease(nb, buf);
+
+	} else if ((event == NBIO_EVENT_EOF) || (event == NBIO_EVENT_ERROR)) {
+		eofs++;
+		nbio_closefdt(nb, fdt);
+	}
+
+	return 0;
+}
+
+/* A frame header for 100 bytes, and only 3 of them */
+static const unsigned char partframe[] = { 0, 100, 'a', 'b', 'c' };
+
+static void frame(int eof)
+{
+	nbio_t nb;
+	nbio_fd_t *fdt;
+	unsigned char *body, *buf;
+	int sv[2];
+
+	testinit(&nb);
+	testpair(sv);
+
+	fdt = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sv[0], 0, handler, NULL, 4, 4);
+	CHECK(fdt != NULL);
+	CHECK(nbio_setframing(&nb, fdt, NBIO_FRAME_U16BE, 1024) == 0);
+
+	CHECK(write(sv[1], partframe, sizeof(partframe)) == sizeof(partframe));
+	testpump(&nb);
+
+	CHECK(fdt->rxchain && (fdt->rxchain->len == 100) && (fdt->rxchain->offset == 3));
+	body = fdt->rxchain ? fdt->rxchain->data : NULL;
+
+	eofs = 0;
+	if (eof) {
+		close(sv[1]);
+		testpump(&nb);
+		CHECK(eofs == 1);
+	} else {
+		nbio_closefdt(&nb, fdt);
+		testpump(&nb);
+		close(sv[1]);
+	}
+
+	buf = nbio_bufget(&nb, 100);
+	CHECK(buf && (buf == body));
+	nbio_bufrelease(&nb, buf);
+
+	nbio_kill(&nb);
+
+	return;
+}
+
+/* An rxpool buffer with 3 bytes in it, which the handler never gets */
+static void rxpool(int eof)
+{
+	nbio_t nb;
+	nbio_fd_t *fdt;
+	unsigned char *part, *buf;
+	int sv[2];
+
+	testinit(&nb);
+	testpair(sv);
+
+	fdt = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sv[0], 0, handler, NULL, 4, 4);
+	CHECK(fdt != NULL);
+	CHECK(nbio_setrxpool(&nb, fdt, 512) == 0);
+
+	CHECK(write(sv[1], "abc", 3) == 3);
+	testpump(&nb);
+
+	CHECK(fdt->rxchain && (fdt->rxchain->offset == 3));
+	part = fdt->rxchain ? fdt->rxchain->data : NULL;
+
+	eofs = 0;
+	if (eof) {
+		close(sv[1]);
+		testpump(&nb);
+		CHECK(eofs == 1);
+	} else {
+		nbio_closefdt(&nb, fdt);
+		testpump(&nb);
+		close(sv[1]);
+	}
+
+	buf = nbio_bufget(&nb, 512);
+	CHECK(buf && (buf == part));
+	nbio_bufrelease(&nb, buf);
+
+	nbio_kill(&nb);
+
+	return;
+}
+
+int main(int argc, char **argv)
+{
+
+	frame(0);
+	frame(1);
+	rxpool(0);
+	rxpool(1);
+
+	return testdone();
+}
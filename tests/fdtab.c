@@ -0,0 +1,67 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * fdts are found through a table indexed by fd, so fds that can't index
+ * it have to be refused, and ones past its end have to grow it.
+ *
+ */
+
+#include "tests.h"
+
+static int handler(void *nbv, int event, nbio_fd_t *fdt)
+{
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	nbio_t nb;
+	nbio_fd_t *fdt;
+	int sv[2], high;
+
+	testinit(&nb);
+	testpair(sv);
+
+	errno = 0;
+	CHECK(!nbio_addfd(&nb, NBIO_FDTYPE_STREAM, -1, 0, handler, NULL, 0, 0) && (errno == EINVAL));
+	errno = 0;
+	CHECK(!nbio_addfd(&nb, NBIO_FDTYPE_STREAM, 1 << 30, 0, handler, NULL, 0, 0) && (errno == EINVAL));
+	errno = 0;
+	CHECK(!nbio_getfdt(&nb, -1) && (errno == ENOENT));
+	CHECK(!nbio_getfdt(&nb, 1 << 30));
+
+	/* Well past the 64 it started with */
+	high = dup2(sv[0], 300);
+	CHECK(high == 300);
+	close(sv[0]);
+	fdt = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, high, 0, handler, NULL, 0, 0);
+	CHECK(fdt != NULL);
+	CHECK(nbio_getfdt(&nb, high) == fdt);
+
+	errno = 0;
+	CHECK(!nbio_addfd(&nb, NBIO_FDTYPE_STREAM, high, 0, handler, NULL, 0, 0) && (errno == EEXIST));
+
+	nbio_closefdt(&nb, fdt);
+	CHECK(!nbio_getfdt(&nb, high));
+
+	nbio_kill(&nb);
+	close(sv[1]);
+
+	return testdone();
+}
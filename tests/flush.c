@@ -0,0 +1,114 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Close-on-flush: exactly one EOF, whether it comes from nbio_poll() or
+ * from nbio_cleanuponly() for a caller that isn't polling.
+ *
+ */
+
+#include "tests.h"
+
+static int eofs;
+
+static int handler(void *nbv, int event, nbio_fd_t *fdt)
+{
+
+	if (event == NBIO_EVENT_EOF)
+		eofs++;
+	else if (event == NBIO_EVENT_WRITE)
+		nbio_remtoptxvector((nbio_t *)nbv, fdt, NULL, NULL);
+
+	return 0;
+}
+
+static void flush(int cleanup)
+{
+	static unsigned char tx[] = "bye";
+	unsigned char buf[8];
+	nbio_t nb;
+	nbio_fd_t *fdt;
+	int sv[2];
+
+	testinit(&nb);
+	testpair(sv);
+
+	fdt = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sv[0], 0, handler, NULL, 4, 4);
+	CHECK(fdt != NULL);
+	eofs = 0;
+
+	/* Not while there's something to write */
+	nbio_addtxvector(&nb, fdt, tx, 3);
+	CHECK(nbio_setcloseonflush(fdt, 1) == 0);
+	CHECK(nbio_cleanuponly(&nb) == 0);
+	CHECK(eofs == 0);
+
+	testpump(&nb);
+	CHECK(read(sv[1], buf, sizeof(buf)) == 3);
+
+	if (cleanup) {
+		CHECK(nbio_cleanuponly(&nb) == 0);
+		CHECK(nbio_cleanuponly(&nb) == 0);
+	}
+	testpump(&nb);
+	CHECK(eofs == 1);
+
+	nbio_closefdt(&nb, fdt);
+	nbio_kill(&nb);
+	close(sv[1]);
+
+	return;
+}
+
+/* Nothing queued at all, and nobody polling */
+static void idle(void)
+{
+	nbio_t nb;
+	nbio_fd_t *fdt;
+	int sv[2];
+
+	testinit(&nb);
+	testpair(sv);
+
+	fdt = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sv[0], 0, handler, NULL, 4, 4);
+	CHECK(fdt != NULL);
+	eofs = 0;
+
+	CHECK(nbio_setcloseonflush(fdt, 1) == 0);
+	CHECK(nbio_cleanuponly(&nb) == 0);
+	CHECK(eofs == 1);
+	CHECK(nbio_cleanuponly(&nb) == 0);
+	testpump(&nb);
+	CHECK(eofs == 1);
+
+	nbio_closefdt(&nb, fdt);
+	nbio_kill(&nb);
+	close(sv[1]);
+
+	return;
+}
+
+int main(int argc, char **argv)
+{
+
+	flush(0);
+	flush(1);
+	idle();
+
+	return testdone();
+}
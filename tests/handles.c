@@ -0,0 +1,123 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * nbio_remrxbuf() and nbio_remtxbuf() take the handle's word for where
+ * it is in the chain, so they have to refuse one that isn't on that
+ * fdt's chain: already removed, on the other chain, or another fdt's.
+ *
+ */
+
+#include "tests.h"
+
+static int handler(void *nbv, int event, nbio_fd_t *fdt)
+{
+	return 0;
+}
+
+/* Walk the chain both ways and make sure it's what's counted */
+static int chainok(nbio_buf_t *head, nbio_buf_t *tail, int count)
+{
+	nbio_buf_t *cur, *prev;
+	int n;
+
+	/* no further than it should go, in case it's gone round in a loop */
+	for (cur = head, prev = NULL, n = 0; cur && (n <= count); prev = cur, cur = cur->next, n++) {
+		if (cur->prev != prev)
+			return 0;
+	}
+
+	return (prev == tail) && (n == count);
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char data[6][16];
+	nbio_t nb;
+	nbio_fd_t *a, *b;
+	nbio_buf_t *a1, *b1, *b2, *b3, *at1, *bt1;
+	int sva[2], svb[2];
+
+	testinit(&nb);
+	testpair(sva);
+	testpair(svb);
+
+	a = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sva[0], 0, handler, NULL, 4, 4);
+	b = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, svb[0], 0, handler, NULL, 4, 4);
+	CHECK(a && b);
+
+	a1 = nbio_addrxbuf(&nb, a, data[0], 16, 0, 0);
+	b1 = nbio_addrxbuf(&nb, b, data[1], 16, 0, 0);
+	b2 = nbio_addrxbuf(&nb, b, data[2], 16, 0, 0);
+	b3 = nbio_addrxbuf(&nb, b, data[3], 16, 0, 0);
+	at1 = nbio_addtxbuf(&nb, a, data[4], 16, 0);
+	bt1 = nbio_addtxbuf(&nb, b, data[5], 16, 0);
+	CHECK(a1 && b1 && b2 && b3 && at1 && bt1);
+
+	/* nothing */
+	errno = 0;
+	CHECK((nbio_remrxbuf(&nb, a, NULL) == -1) && (errno == EINVAL));
+	errno = 0;
+	CHECK((nbio_remtxbuf(&nb, a, NULL) == -1) && (errno == EINVAL));
+
+	/* another fdt's: its head, its middle, and its tail */
+	errno = 0;
+	CHECK((nbio_remrxbuf(&nb, a, b1) == -1) && (errno == EINVAL));
+	CHECK((nbio_remrxbuf(&nb, a, b2) == -1) && (errno == EINVAL));
+	CHECK((nbio_remrxbuf(&nb, a, b3) == -1) && (errno == EINVAL));
+	CHECK((nbio_remtxbuf(&nb, a, bt1) == -1) && (errno == EINVAL));
+
+	/* the other chain on the same fdt */
+	CHECK((nbio_remrxbuf(&nb, a, at1) == -1) && (errno == EINVAL));
+	CHECK((nbio_remtxbuf(&nb, a, a1) == -1) && (errno == EINVAL));
+
+	CHECK((a->rxqueued == 1) && chainok(a->rxchain, a->rxchain_tail, 1));
+	CHECK((b->rxqueued == 3) && chainok(b->rxchain, b->rxchain_tail, 3));
+	CHECK((a->txqueued == 1) && chainok(a->txchain, a->txchain_tail, 1));
+	CHECK((b->txqueued == 1) && chainok(b->txchain, b->txchain_tail, 1));
+
+	/* already taken off */
+	CHECK(nbio_remrxbuf(&nb, b, b2) == 0);
+	errno = 0;
+	CHECK((nbio_remrxbuf(&nb, b, b2) == -1) && (errno == EINVAL));
+	CHECK(nbio_remtxbuf(&nb, a, at1) == 0);
+	errno = 0;
+	CHECK((nbio_remtxbuf(&nb, a, at1) == -1) && (errno == EINVAL));
+
+	CHECK((b->rxqueued == 2) && chainok(b->rxchain, b->rxchain_tail, 2));
+	CHECK((b->rxchain == b1) && (b1->next == b3));
+	CHECK((a->txqueued == 0) && chainok(a->txchain, a->txchain_tail, 0));
+
+	/* and the rest still come off normally */
+	CHECK(nbio_remrxbuf(&nb, a, a1) == 0);
+	CHECK(nbio_remrxbuf(&nb, b, b3) == 0);
+	CHECK(nbio_remrxbuf(&nb, b, b1) == 0);
+	CHECK(nbio_remtxbuf(&nb, b, bt1) == 0);
+	CHECK(!a->rxchain && !b->rxchain && !b->txchain);
+	CHECK((a->rxqueued == 0) && (b->rxqueued == 0) && (b->txqueued == 0));
+
+	/* If the chains are wrecked, tearing them down may never finish */
+	if (failures)
+		return testdone();
+
+	nbio_kill(&nb);
+	close(sva[1]);
+	close(svb[1]);
+
+	return testdone();
+}
@@ -0,0 +1,117 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Dispatch starts at maxpri, so anything still queued above it when the
+ * fdts there go away has to be dealt with: closed ones dropped (and
+ * freed), and ones moved down by nbio_setpri() still dispatched.
+ *
+ */
+
+#include "tests.h"
+
+#include <limits.h>
+
+static nbio_fd_t *victim;
+static int victimeofs;
+
+static int handler(void *nbv, int event, nbio_fd_t *fdt)
+{
+
+	if ((event == NBIO_EVENT_EOF) && (fdt == victim))
+		victimeofs++;
+
+	return 0;
+}
+
+/*
+ * The victim's close-on-flush EOF is queued at its priority straight
+ * away, and then, before anything is dispatched, it's closed or moved
+ * down, leaving maxpri below where it's queued.
+ */
+static void queued(int move)
+{
+	nbio_t nb;
+	nbio_fd_t *low;
+	int lsv[2], vsv[2];
+
+	testinit(&nb);
+	testpair(lsv);
+	testpair(vsv);
+
+	low = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, lsv[0], 0, handler, NULL, 0, 0);
+	victim = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, vsv[0], 5, handler, NULL, 0, 0);
+	CHECK(low && victim && (nb.maxpri == 5));
+	victimeofs = 0;
+
+	CHECK(nbio_setcloseonflush(victim, 1) == 0);
+	CHECK(nb.readycount == 1);
+	if (move)
+		CHECK(nbio_setpri(&nb, victim, 0) == 0);
+	else
+		CHECK(nbio_closefdt(&nb, victim) == 0);
+	CHECK(nb.maxpri == 0);
+
+	testpump(&nb);
+	CHECK(nb.readycount == 0);
+	CHECK(victimeofs == (move ? 1 : 0));
+
+	nbio_kill(&nb);
+	close(lsv[1]);
+	close(vsv[1]);
+
+	return;
+}
+
+static void limits(void)
+{
+	nbio_t nb;
+	nbio_fd_t *fdt;
+	int sv[2];
+
+	testinit(&nb);
+	testpair(sv);
+
+	errno = 0;
+	CHECK(!nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sv[0], INT_MAX, handler, NULL, 0, 0) && (errno == EINVAL));
+
+	fdt = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sv[0], NBIO_PRI_MAX, handler, NULL, 0, 0);
+	CHECK(fdt != NULL);
+	errno = 0;
+	CHECK((nbio_setpri(&nb, fdt, NBIO_PRI_MAX + 1) == -1) && (errno == EINVAL));
+	errno = 0;
+	CHECK((nbio_setpri(&nb, fdt, INT_MAX) == -1) && (errno == EINVAL));
+	CHECK((fdt->pri == NBIO_PRI_MAX) && (nb.maxpri == NBIO_PRI_MAX));
+	CHECK(nbio_setpri(&nb, fdt, 0) == 0);
+	CHECK(nb.maxpri == 0);
+
+	nbio_kill(&nb);
+	close(sv[1]);
+
+	return;
+}
+
+int main(int argc, char **argv)
+{
+
+	queued(0);
+	queued(1);
+	limits();
+
+	return testdone();
+}
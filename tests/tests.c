@@ -0,0 +1,73 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * The helpers from tests.h, built once and linked into every test.
+ *
+ */
+
+#include "tests.h"
+
+int failures = 0;
+
+/* one end for the library, the other for the test to poke at */
+void testpair(int sv[2])
+{
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair");
+		exit(2);
+	}
+
+	return;
+}
+
+void testinit(nbio_t *nb)
+{
+
+	if (nbio_init(nb, 64) == -1) {
+		perror("nbio_init");
+		exit(2);
+	}
+
+	return;
+}
+
+/* Run passes until nothing more happens (or there have been a lot) */
+void testpump(nbio_t *nb)
+{
+	int i, idle;
+
+	for (i = 0, idle = 0; (i < 100) && (idle < 3); i++) {
+		if (nbio_poll(nb, 5) > 0)
+			idle = 0;
+		else
+			idle++;
+	}
+
+	return;
+}
+
+int testdone(void)
+{
+
+	if (failures)
+		fprintf(stderr, "%d failed\n", failures);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Bits shared by the tests.  Each test is its own program, run by
+ * "make check", and exits non-zero if any CHECK failed.  They use
+ * whatever backend nbio_init() picks, so $NBIO_BACKEND runs them
+ * against another one.
+ *
+ */
+
+#ifndef __NBIO_TESTS_H__
+#define __NBIO_TESTS_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <libnbio.h>
+
+extern int failures;
+
+#define CHECK(x) do { \
+	if (!(x)) { \
+		fprintf(stderr, "%s:%d: %s: failed: %s\n", __FILE__, __LINE__, __func__, #x); \
+		failures++; \
+	} \
+} while (0)
+
+/* tests.c */
+void testpair(int sv[2]);
+void testinit(nbio_t *nb);
+void testpump(nbio_t *nb);
+int testdone(void);
+
+#endif /* __NBIO_TESTS_H__ */
@@ -0,0 +1,94 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Timer wheel regressions.
+ *
+ */
+
+#include "tests.h"
+
+#include <time.h>
+
+static int fired;
+
+static int callback(nbio_t *nb, nbio_timer_t *timer, void *udata)
+{
+	fired++;
+	return 0;
+}
+
+static unsigned long long msnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((unsigned long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/*
+ * A timer a little under a full turn of the second wheel out lands in
+ * the second wheel's current slot, for next time round.  A short timer
+ * a couple of slots later on the same wheel used to be missed when
+ * working out how long to sleep, so it fired a turn (about 4s) late.
+ */
+static void samelevel(void)
+{
+	nbio_t nb;
+	nbio_timer_t *far, *near;
+	unsigned long long start, el;
+	int tries;
+
+	testinit(&nb);
+
+	/* The wheel starts at the clock; it has to be partway into a slot */
+	for (tries = 0; tries < 100; tries++) {
+		far = nbio_addtimer(&nb, NULL, 4095, 0, callback, NULL);
+		if (nbio_now(&nb) & 63)
+			break;
+		nbio_deltimer(&nb, far);
+		usleep(1000);
+	}
+	CHECK(far != NULL);
+
+	near = nbio_addtimer(&nb, NULL, 100, 0, callback, NULL);
+	CHECK(near != NULL);
+
+	fired = 0;
+	start = msnow();
+	while (!fired && (msnow() - start < 6000))
+		nbio_poll(&nb, 10000);
+	el = msnow() - start;
+
+	CHECK(fired == 1);
+	CHECK(el < 1000);
+
+	nbio_deltimer(&nb, far);
+	nbio_kill(&nb);
+
+	return;
+}
+
+int main(int argc, char **argv)
+{
+
+	samelevel();
+
+	return testdone();
+}
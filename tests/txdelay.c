@@ -0,0 +1,122 @@
+/*
+ * libnbio - Portable wrappers for non-blocking sockets
+ * Copyright (c) 2000-2005 Adam Fritzler <mid@zigamorph.net>, et al
+ *
+ * libnbio is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License (version 2.1) as published by
+ * the Free Software Foundation.
+ *
+ * libnbio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Delayed tx buffers (nbio_addtxvector_time()) sleep on a timer until
+ * they're due.  They have to go out on time, not up to a second after,
+ * and one due far in the future mustn't leave the stream spinning on
+ * POLLOUT.
+ *
+ */
+
+#include "tests.h"
+
+#include <time.h>
+#include <sys/time.h>
+
+static int handler(void *nbv, int event, nbio_fd_t *fdt)
+{
+
+	if (event == NBIO_EVENT_WRITE)
+		nbio_remtoptxvector((nbio_t *)nbv, fdt, NULL, NULL);
+
+	return 0;
+}
+
+static unsigned long long wallms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return ((unsigned long long)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+/* Queued partway into a second, for the start of the next one */
+static void ontime(void)
+{
+	static unsigned char tx[] = "due";
+	unsigned char buf[8];
+	unsigned long long start;
+	nbio_t nb;
+	nbio_fd_t *fdt;
+	time_t trigger;
+	long late;
+	int sv[2];
+
+	testinit(&nb);
+	testpair(sv);
+
+	fdt = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sv[0], 0, handler, NULL, 4, 4);
+	CHECK(fdt != NULL);
+
+	while (((wallms() % 1000) < 300) || ((wallms() % 1000) > 700))
+		usleep(10000);
+	trigger = (time_t)(wallms() / 1000) + 1;
+	CHECK(nbio_addtxvector_time(&nb, fdt, tx, 3, trigger) == 0);
+
+	start = wallms();
+	while ((recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT) != 3) && (wallms() - start < 3000))
+		nbio_poll(&nb, 2000);
+	late = (long)(wallms() - ((unsigned long long)trigger * 1000));
+
+	CHECK(late >= -20);
+	CHECK(late < 200);
+
+	nbio_kill(&nb);
+	close(sv[1]);
+
+	return;
+}
+
+static void farout(void)
+{
+	static unsigned char tx[] = "later";
+	unsigned long long start;
+	nbio_t nb;
+	nbio_fd_t *fdt;
+	int sv[2], passes;
+
+	testinit(&nb);
+	testpair(sv);
+
+	fdt = nbio_addfd(&nb, NBIO_FDTYPE_STREAM, sv[0], 0, handler, NULL, 4, 4);
+	CHECK(fdt != NULL);
+
+	/* Thirty days: more milliseconds than an int holds */
+	CHECK(nbio_addtxvector_time(&nb, fdt, tx, 5, time(NULL) + (30 * 24 * 3600)) == 0);
+
+	start = wallms();
+	for (passes = 0; wallms() - start < 100; passes++)
+		nbio_poll(&nb, 20);
+	CHECK(passes < 20);
+
+	nbio_kill(&nb);
+	close(sv[1]);
+
+	return;
+}
+
+int main(int argc, char **argv)
+{
+
+	ontime();
+	farout();
+
+	return testdone();
+}